@@ -3,6 +3,80 @@
 #include "svd.hpp"
 
 #include <iostream>
+#include <limits>
+#include <cmath>
+
+// Decides how much imaginary time can be multiplied into a product before
+// it has to be stabilized again. The growth rate of the spread
+// log(S.max/S.min) is measured at every stabilization; a block whose spread
+// grows by x loses a factor exp(x) of relative precision on the smallest
+// scales, so the interval is chosen to keep that above prec.
+// When not adaptive the fixed interval is used.
+class StabilizationSchedule {
+	double budget;
+	double rate;
+	double last_spread;
+	double fixed;
+	double min_interval;
+	double max_interval;
+	bool adaptive;
+	size_t count;
+	double time;
+
+	public:
+
+	StabilizationSchedule (double dtau = 1.0/3.0) : rate(0.0), last_spread(0.0), adaptive(false), count(0), time(0.0) {
+		setInterval(dtau);
+		setPrecision(1.0e-10);
+	}
+
+	// also resets the limits to [dtau/16, 16*dtau]
+	void setInterval (double dtau) {
+		fixed = dtau;
+		min_interval = dtau/16.0;
+		max_interval = dtau*16.0;
+	}
+
+	void setLimits (double a, double b) { min_interval = a; max_interval = b; }
+	void setAdaptive (bool a) { adaptive = a; }
+	void setPrecision (double prec) { budget = std::log(prec/std::numeric_limits<double>::epsilon()); }
+	bool isAdaptive () const { return adaptive; }
+
+	template <typename T>
+	static double spread (const T &S) { return std::log(S.maxCoeff()/S.minCoeff()); }
+
+	void start (double s) { last_spread = s; }
+
+	// to be called after every stabilization, dist being the time since the
+	// last one; too short blocks (e.g. at the end of a product) are not used
+	// for the estimate
+	void update (double s, double dist) {
+		if (dist>=min_interval && dist>0.0) {
+			double r = std::fabs(s-last_spread)/dist;
+			rate = rate>0.0?0.5*(rate+r):r;
+		}
+		last_spread = s;
+		count++;
+		time += dist;
+	}
+
+	double interval () const {
+		if (!adaptive || rate<=0.0) return fixed;
+		return std::min(max_interval, std::max(min_interval, budget/rate));
+	}
+
+	double growthRate () const { return rate; }
+	size_t stabilizations () const { return count; }
+	double averageInterval () const { return count>0?time/count:0.0; }
+	// number of stabilizations the fixed interval would have needed
+	double fixedStabilizations () const { return time/fixed; }
+	void resetStats () { count = 0; time = 0.0; }
+
+	void report (std::ostream &out) const {
+		out << "stabilizations: " << count << " (average interval " << averageInterval()
+			<< ", fixed schedule " << fixedStabilizations() << ", growth rate " << rate << ")" << std::endl;
+	}
+};
 
 class Accumulator {
 	using SVDMatrix = SVDHelper;
@@ -10,6 +84,7 @@ class Accumulator {
 	double total_logdet;
 	double current_logdet;
 	double dist;
+	StabilizationSchedule sched;
 
 	typedef typename SVDMatrix::Matrix Matrix;
 
@@ -21,6 +96,7 @@ class Accumulator {
 		total_logdet = 0.0;
 		current_logdet = 0.0;
 		dist = 0.0;
+		sched.start(StabilizationSchedule::spread(svd.S));
 	}
 
 	void reset (size_t V) {
@@ -28,6 +104,7 @@ class Accumulator {
 		total_logdet = 0.0;
 		current_logdet = 0.0;
 		dist = 0.0;
+		sched.start(0.0);
 	}
 
 	Matrix &matrixU () { return svd.U; }
@@ -47,10 +124,16 @@ class Accumulator {
 
 	void decomposeU () {
 		svd.absorbU();
+		sched.update(StabilizationSchedule::spread(svd.S), dist);
 		current_logdet = 0.0;
 		dist = 0.0;
 	}
 
+	// distance after which decomposeU is due
+	double interval () const { return sched.interval(); }
+	const StabilizationSchedule& schedule () const { return sched; }
+	StabilizationSchedule& schedule () { return sched; }
+
 	bool testLogDet (double prec = 1.0e-6) const {
 		return std::fabs(svd.S.array().log().sum()-total_logdet)<prec;
 	}
@@ -0,0 +1,300 @@
+#include "simulation.hpp"
+#include "measurements.hpp"
+#include "accumulator.hpp"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+
+#include <Eigen/QR>
+#include <Eigen/Eigenvalues>
+
+using namespace std;
+using namespace std::chrono;
+
+typedef std::chrono::duration<double> seconds_type;
+
+// distinguishes the builds of the Makefile (optimized / mkl / parallel / debug)
+#if defined EIGEN_USE_MKL_ALL
+#define BENCH_BUILD "mkl"
+#elif defined _OPENMP
+#define BENCH_BUILD "parallel"
+#elif defined NDEBUG
+#define BENCH_BUILD "optimized"
+#else
+#define BENCH_BUILD "debug"
+#endif
+
+struct Timing {
+	string kernel;
+	string variant;
+	int V;
+	int N;
+	double beta;
+	long calls;
+	double seconds;
+};
+
+class Bench {
+	vector<Timing> results;
+	double min_time;
+
+	public:
+
+	// calls f once to warm up, then until min_time has passed
+	void time (const string &kernel, const string &variant, int V, int N, double beta, const function<void()> &f) {
+		f();
+		long calls = 0;
+		steady_clock::time_point t0 = steady_clock::now();
+		double t = 0.0;
+		do {
+			f();
+			calls++;
+			t = duration_cast<seconds_type>(steady_clock::now()-t0).count();
+		} while (t<min_time);
+		Timing r = { kernel, variant, V, N, beta, calls, t };
+		results.push_back(r);
+		std::cerr << kernel << ' ' << variant << " V=" << V << " N=" << N << ": " << t/calls << "s per call" << std::endl;
+	}
+
+	void write (ostream &out, const string &tag) const {
+		out << std::setprecision(6);
+		out << "{\n\t\"build\": \"" << tag << "\",\n\t\"compiled\": \"" << __DATE__ << ' ' << __TIME__ << "\",\n";
+		out << "\t\"min_time\": " << min_time << ",\n\t\"results\": [\n";
+		for (size_t i=0;i<results.size();i++) {
+			const Timing &r = results[i];
+			out << "\t\t{ \"kernel\": \"" << r.kernel << "\", \"variant\": \"" << r.variant << "\", \"V\": " << r.V
+				<< ", \"N\": " << r.N << ", \"beta\": " << r.beta << ", \"calls\": " << r.calls
+				<< ", \"seconds\": " << r.seconds << ", \"per_call\": " << r.seconds/r.calls << " }"
+				<< (i+1<results.size()?",":"") << '\n';
+		}
+		out << "\t]\n}" << std::endl;
+	}
+
+	Bench (double t) : min_time(t) {}
+};
+
+// square periodic lattice with unit hopping at U=4, half filling
+Simulation* make_simulation (int L, double beta, int N, const string &propagator) {
+	lua_State *S = luaL_newstate();
+	luaL_openlibs(S);
+	lua_newtable(S);
+	lua_pushinteger(S, L); lua_setfield(S, -2, "Lx");
+	lua_pushinteger(S, L); lua_setfield(S, -2, "Ly");
+	lua_pushinteger(S, 1); lua_setfield(S, -2, "Lz");
+	lua_pushinteger(S, N); lua_setfield(S, -2, "N");
+	lua_pushnumber(S, beta); lua_setfield(S, -2, "beta");
+	lua_pushnumber(S, -4.0); lua_setfield(S, -2, "U");
+	lua_pushnumber(S, 0.0); lua_setfield(S, -2, "mu");
+	lua_pushnumber(S, 0.0); lua_setfield(S, -2, "B");
+	lua_pushnumber(S, 1.0); lua_setfield(S, -2, "tx");
+	lua_pushnumber(S, 1.0); lua_setfield(S, -2, "ty");
+	lua_pushnumber(S, 0.0); lua_setfield(S, -2, "tz");
+	lua_pushinteger(S, 4242); lua_setfield(S, -2, "SEED");
+	lua_pushstring(S, ""); lua_setfield(S, -2, "OUTPUT");
+	lua_pushstring(S, ""); lua_setfield(S, -2, "gf_file");
+	lua_pushinteger(S, 1); lua_setfield(S, -2, "SLICES");
+	lua_pushinteger(S, 4); lua_setfield(S, -2, "SVD");
+	lua_pushinteger(S, 1); lua_setfield(S, -2, "flips_per_update");
+	lua_pushinteger(S, 1); lua_setfield(S, -2, "max_update_size");
+	// a weak trap breaks translation invariance and so forces the dense propagator
+	if (propagator=="dense") { lua_pushnumber(S, 1.0e-3); lua_setfield(S, -2, "w_x"); }
+	if (propagator=="checkerboard") { lua_pushboolean(S, 1); lua_setfield(S, -2, "checkerboard"); }
+	Simulation *ret = new Simulation(S, -1);
+	lua_close(S);
+	return ret;
+}
+
+// random decomposition of a well conditioned V x V matrix
+void random_svd (SVDHelper &s, int V, SVDHelper::Method m) {
+	s.setMethod(m);
+	s.setIdentity(V);
+	s.U = Matrix_d::Random(V, V);
+	s.resetSigns();
+	s.absorbU();
+}
+
+void bench_svd (Bench &bench, int V) {
+	for (SVDHelper::Method m : { SVDHelper::SVD, SVDHelper::UDT }) {
+		const string variant = m==SVDHelper::UDT?"udt":"svd";
+		SVDHelper a, b;
+		random_svd(a, V, m);
+		random_svd(b, V, m);
+		bench.time("absorbU", variant, V, 0, 0.0, [&] () {
+				a.U.array() *= 1.0 + 1.0e-3*a.U.array();
+				a.absorbU();
+				});
+		bench.time("add_identity", variant, V, 0, 0.0, [&] () { a.add_identity(); });
+		bench.time("add_svd", variant, V, 0, 0.0, [&] () { a.add_svd(b); });
+	}
+}
+
+void bench_simulation (Bench &bench, int L, double beta, int N, bool propagation) {
+	const int V = L*L;
+	for (string p : { "fft", "dense", "checkerboard" }) {
+		unique_ptr<Simulation> sim(make_simulation(L, beta, N, p));
+		bench.time("make_svd", p, V, N, beta, [&] () { sim->make_svd(); });
+		if (propagation) {
+			Matrix_d A = Matrix_d::Identity(V, V);
+			int n = 0;
+			bench.time("propagate_slice", p, V, 0, 0.0, [&] () {
+					sim->queue_first_slice(A);
+					if (++n%16==0) A /= A.cwiseAbs().maxCoeff();
+					});
+		}
+		if (p=="fft") {
+			int x = 0;
+			double acc = 0.0;
+			bench.time("rank1_probability", "", V, 0, 0.0, [&] () {
+					acc += sim->rank1_probability(x).first;
+					x = (x+1)%V;
+					});
+			if (acc==0.0) std::cerr << "rank1_probability vanished" << std::endl;
+		}
+	}
+}
+
+// the kernels of v3ct: propagating the update vectors of an inserted vertex
+// through the other vertices of its slice in the eigenbasis of the hopping,
+// and a slice product with known determinant in an Accumulator
+void bench_v3 (Bench &bench, int L, double beta, int N) {
+	const int V = L*L;
+	const double dtau = beta/N;
+	Matrix_d H = Matrix_d::Zero(V, V);
+	for (int x=0;x<L;x++) {
+		for (int y=0;y<L;y++) {
+			const int a = x*L+y;
+			H(a, ((x+1)%L)*L+y) = H(((x+1)%L)*L+y, a) = -1.0;
+			H(a, x*L+(y+1)%L) = H(x*L+(y+1)%L, a) = -1.0;
+		}
+	}
+	Eigen::SelfAdjointEigenSolver<Matrix_d> solver(H);
+	const Matrix_d &eigenvectors = solver.eigenvectors();
+	const Array_d eigenvalues = solver.eigenvalues().array();
+	std::mt19937_64 generator(4242);
+	std::uniform_int_distribution<int> site(0, V-1);
+	std::uniform_real_distribution<double> when(0.0, dtau);
+	// vertex density of an interaction of strength 4 at half filling
+	const int K = std::max(1, int(V*dtau));
+	vector<pair<double, int>> verts;
+	for (int k=0;k<K;k++) verts.push_back(make_pair(when(generator), site(generator)));
+	sort(verts.begin(), verts.end());
+	Vector_d u, v;
+	int w = 0;
+	bench.time("compute_update_vectors", "exp", V, N, beta, [&] () {
+			const int x = site(generator);
+			const double s = w%2?1.0:-1.0;
+			double t = 0.0;
+			u = eigenvectors.row(x).transpose();
+			v = u;
+			for (const pair<double, int> &i : verts) {
+				u.array() *= (-(i.first-t)*eigenvalues).exp();
+				u += s * eigenvectors.row(i.second).transpose() * (eigenvectors.row(i.second) * u);
+				t = i.first;
+			}
+			u.array() *= (-(dtau-t)*eigenvalues).exp();
+			t = dtau;
+			for (auto i=verts.rbegin();i!=verts.rend();++i) {
+				v.array() *= (-(t-i->first)*eigenvalues).exp();
+				v += s * eigenvectors.row(i->second).transpose() * (eigenvectors.row(i->second) * v);
+				t = i->first;
+			}
+			v.array() *= (-t*eigenvalues).exp();
+			w++;
+			});
+	// the same with exp(-tau*E) and exp(+tau*E) kept per vertex as in the
+	// vertex store of v3ct
+	vector<Array_d> forward, backward;
+	for (const pair<double, int> &i : verts) {
+		forward.push_back((-i.first*eigenvalues).exp());
+		backward.push_back(forward.back().inverse());
+	}
+	const Array_d whole = (-dtau*eigenvalues).exp();
+	const Array_d ones = Array_d::Ones(V);
+	bench.time("compute_update_vectors", "cached", V, N, beta, [&] () {
+			const int x = site(generator);
+			const double s = w%2?1.0:-1.0;
+			const Array_d *back = &ones;
+			u = eigenvectors.row(x).transpose();
+			v = u;
+			for (size_t k=0;k<verts.size();k++) {
+				const pair<double, int> &i = verts[k];
+				u.array() *= forward[k] * *back;
+				u += s * eigenvectors.row(i.second).transpose() * (eigenvectors.row(i.second) * u);
+				back = &backward[k];
+			}
+			u.array() *= whole * *back;
+			const Array_d *fwd = &whole;
+			for (size_t k=verts.size();k-->0;) {
+				const pair<double, int> &i = verts[k];
+				v.array() *= *fwd * backward[k];
+				v += s * eigenvectors.row(i.second).transpose() * (eigenvectors.row(i.second) * v);
+				fwd = &forward[k];
+			}
+			v.array() *= *fwd;
+			w++;
+			});
+	const Matrix_d Q = Matrix_d::Random(V, V).householderQr().householderQ();
+	Accumulator acc;
+	Array_d r;
+	bench.time("accumulate", "", V, N, beta, [&] () {
+			acc.reset(V);
+			for (int i=0;i<N;i++) {
+				r = dtau*Array_d::Random(V);
+				acc.matrixU().applyOnTheLeft(Q);
+				acc.matrixU().array().colwise() *= r.exp();
+				acc.increase_logdet(r.sum());
+				if ((i+1)%4==0) acc.decomposeU();
+			}
+			acc.decomposeU();
+			});
+	if (!acc.testLogDet()) std::cerr << "accumulate: logdet error " << acc.logDetError() << std::endl;
+}
+
+void bench_measurements (Bench &bench, int V) {
+	std::mt19937_64 generator(4242);
+	std::normal_distribution<double> normal;
+	mymeasurement<double> scalar;
+	bench.time("measurement_add", "scalar", V, 0, 0.0, [&] () {
+			for (int i=0;i<V;i++) scalar.add(normal(generator));
+			});
+	mymeasurement<Eigen::ArrayXXd> array;
+	Array_d c = Array_d::Random(V);
+	bench.time("measurement_add", "array", V, 0, 0.0, [&] () {
+			c += 1.0e-3*c.square();
+			array.add(c);
+			});
+}
+
+int main (int argc, char **argv) {
+	string tag = BENCH_BUILD;
+	int max_V = 1024;
+	double min_time = 0.5;
+	if (argc>1) tag = argv[1];
+	if (argc>2) stringstream(argv[2]) >> max_V;
+	if (argc>3) stringstream(argv[3]) >> min_time;
+
+	Bench bench(min_time);
+	const double betas[] = { 1.0, 4.0, 10.0 };
+	const double dt = 0.125;
+	for (int L : { 4, 8, 16, 32 }) {
+		const int V = L*L;
+		if (V>max_V) break;
+		bench_svd(bench, V);
+		bench_measurements(bench, V);
+		for (double beta : betas) {
+			const int N = int(beta/dt+0.5);
+			bench_simulation(bench, L, beta, N, beta==betas[0]);
+			bench_v3(bench, L, beta, N);
+		}
+	}
+	bench.write(std::cout, tag);
+	return 0;
+}
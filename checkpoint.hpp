@@ -0,0 +1,213 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "measurements.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// binary checkpoints: an 8 byte magic and a format version, then records of
+// native-endian int64s, doubles and length-prefixed strings. Files not starting
+// with the magic are left to the Lua loader, so old text checkpoints still work.
+#define CHECKPOINT_MAGIC "DQMCCKPT"
+#define CHECKPOINT_VERSION 1
+
+// outcome of loading a binary checkpoint: a file that is not one is left to
+// the Lua loader, a damaged one or one of another version is not loaded
+enum CheckpointStatus { CheckpointLoaded, CheckpointNotBinary, CheckpointDamaged };
+
+class CheckpointWriter {
+	std::vector<char> buffer;
+
+	void put (const void *p, size_t n) {
+		const char *c = static_cast<const char*>(p);
+		buffer.insert(buffer.end(), c, c+n);
+	}
+
+	public:
+
+	template <typename T>
+	void write (const T &x) {
+		static_assert(std::is_arithmetic<T>::value, "only numbers are written directly");
+		put(&x, sizeof(T));
+	}
+
+	void write (const std::string &s) {
+		write(int64_t(s.size()));
+		put(s.data(), s.size());
+	}
+
+	void write (const double *x, size_t n) {
+		write(int64_t(n));
+		put(x, n*sizeof(double));
+	}
+
+	template <bool Log>
+	void write (const std::string &key, const measurement<double, Log> &m) {
+		write(key);
+		write(m.name());
+		write(int64_t(m.bins()));
+		for (size_t i=0;i<m.bins();i++) {
+			write(int64_t(m.samples(i)));
+			write(m.sum(i));
+			write(m.square(i));
+			write(m.last_value(i));
+		}
+	}
+
+	// writes fn.tmp and renames it over fn, so that an interrupted save
+	// never leaves a truncated checkpoint behind
+	bool commit (const std::string &fn) const {
+		const std::string tmp = fn + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd<0) {
+			std::cerr << "cannot open checkpoint " << tmp << std::endl;
+			return false;
+		}
+		const char *p = buffer.data();
+		size_t left = buffer.size();
+		while (left>0) {
+			ssize_t n = ::write(fd, p, left);
+			if (n<0) break;
+			p += n;
+			left -= n;
+		}
+		bool ok = left==0 && ::fsync(fd)==0;
+		ok = ::close(fd)==0 && ok;
+		if (!ok || std::rename(tmp.c_str(), fn.c_str())!=0) {
+			std::cerr << "failed writing checkpoint " << fn << std::endl;
+			std::remove(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	CheckpointWriter () {
+		put(CHECKPOINT_MAGIC, 8);
+		write(int32_t(CHECKPOINT_VERSION));
+	}
+};
+
+// reads a binary checkpoint through a read-only mapping; running past the end
+// of the file clears good() instead of reading garbage
+class CheckpointReader {
+	const char *data;
+	size_t size;
+	size_t pos;
+	bool ok;
+
+	const char* get (size_t n) {
+		if (!ok || n>size-pos) {
+			ok = false;
+			return nullptr;
+		}
+		const char *ret = data+pos;
+		pos += n;
+		return ret;
+	}
+
+	void release () {
+		if (data!=nullptr) ::munmap(const_cast<char*>(data), size);
+		data = nullptr;
+		size = pos = 0;
+	}
+
+	public:
+
+	// false if the file is missing or not a binary checkpoint
+	bool open (const std::string &fn) {
+		release();
+		ok = false;
+		int fd = ::open(fn.c_str(), O_RDONLY);
+		if (fd<0) return false;
+		struct stat st;
+		if (::fstat(fd, &st)==0 && st.st_size>=12) {
+			void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p!=MAP_FAILED) {
+				data = static_cast<const char*>(p);
+				size = st.st_size;
+			}
+		}
+		::close(fd);
+		if (data==nullptr || std::memcmp(data, CHECKPOINT_MAGIC, 8)!=0) {
+			release();
+			return false;
+		}
+		ok = true;
+		pos = 8;
+		int32_t v = read<int32_t>();
+		if (v!=CHECKPOINT_VERSION) {
+			std::cerr << "checkpoint " << fn << " has version " << v << ", expected " << CHECKPOINT_VERSION << std::endl;
+			ok = false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	T read () {
+		static_assert(std::is_arithmetic<T>::value, "only numbers are read directly");
+		T ret = T();
+		const char *p = get(sizeof(T));
+		if (p!=nullptr) std::memcpy(&ret, p, sizeof(T));
+		return ret;
+	}
+
+	std::string read_string () {
+		int64_t n = read<int64_t>();
+		if (n<0) ok = false;
+		const char *p = get(n);
+		return p!=nullptr?std::string(p, n):std::string();
+	}
+
+	// array of n doubles inside the mapping, valid until the reader goes away;
+	// not necessarily aligned, so use value() to access it
+	const char* read_array (int64_t &n) {
+		n = read<int64_t>();
+		if (n<0 || size_t(n)>(size-pos)/sizeof(double)) ok = false;
+		const char *p = get(n*sizeof(double));
+		if (p==nullptr) n = 0;
+		return p;
+	}
+
+	static double value (const char *array, int64_t i) {
+		double ret;
+		std::memcpy(&ret, array+i*sizeof(double), sizeof(double));
+		return ret;
+	}
+
+	// reads the next measurement record into m and returns its key
+	template <bool Log>
+	std::string read (measurement<double, Log> &m) {
+		std::string key = read_string();
+		m.set_name(read_string());
+		int64_t b = read<int64_t>();
+		if (b<0 || size_t(b)>(size-pos)/32) ok = false;
+		m.set_bins(ok?b:0);
+		for (int64_t i=0;ok && i<b;i++) {
+			m.set_samples(i, read<int64_t>());
+			m.set_sum(i, read<double>());
+			m.set_squared_sum(i, read<double>());
+			m.set_last_value(i, read<double>());
+		}
+		return key;
+	}
+
+	bool good () const { return ok; }
+
+	CheckpointReader () : data(nullptr), size(0), pos(0), ok(false) {}
+	CheckpointReader (const CheckpointReader &) = delete;
+	CheckpointReader& operator= (const CheckpointReader &) = delete;
+	~CheckpointReader () { release(); }
+};
+
+#endif // CHECKPOINT_HPP
@@ -61,11 +61,24 @@ for y in range(mu_max, mu_max, 30) do
 				h = 0.0e-2,
 				THERMALIZATION = 300,
 				SWEEPS = 300,
+				CHAINS = 1, -- independent chains sharing the sweeps of this task, merged into one result
+				--REPLICAS = { 4.0, 5.0, 6.0 }, -- replica exchange between these values of EXCHANGE, one result per replica
+				EXCHANGE = "beta", -- parameter of the REPLICAS ladder, "beta" or "mu"
+				EXCHANGE_INTERVAL = 0, -- updates between swap attempts, 0 for N
 				SEED = seed,
 				OUTPUT = 'sign_',
 				SLICES = 1,
 				SVD = 1,
-				max_update_size = 1,
+				decomposition = "svd", -- or "udt" for pivoted QR
+				svd_driver = "gesvd", -- "gesdd", "gesvj" or "auto" to time them once per size
+				mixed_precision = false, -- single precision slices between SVDs (no FFT only)
+				adaptive_svd = false, -- pick the slices between SVDs from the growth of the scales
+				max_update_size = 0, -- fold accepted flips into the Green function after this many, 0 to wait for the shift
+				parallel_spins = false, -- spin up and down chains on two threads of this simulation
+				checkerboard = false, -- sparse kinetic propagator from bond families (Trotter error dt^3 per slice)
+				gf_interval = 1, -- unequal time Green function every this many measurements (needs gf_file)
+				gf_reduced = false, -- store G(r, tau) averaged over translations and lattice symmetries
+				corr_file = "", -- spin, density and d-wave pair correlations C(r) and S(q)
 				flips_per_update = 1;
 				open_boundary = true,
 				savefile = "save.test",
@@ -0,0 +1,152 @@
+#ifndef CORRELATIONS_HPP
+#define CORRELATIONS_HPP
+
+#include "types.hpp"
+
+#include <vector>
+
+extern "C" {
+#include <fftw3.h>
+}
+
+#include <Eigen/Dense>
+
+// equal time correlation functions of a periodic Lx*Ly*Lz lattice for all
+// displacements r at once, and their structure factors S(q). Site products
+// of one-body quantities are circular correlations done with FFTs, the
+// exchange terms of Wick's theorem are translation sums of element-wise
+// products of the density matrices, so everything is O(V^2) per sample.
+class CorrelationFunctions {
+	int Lx, Ly, Lz, V;
+	fftw_plan forward;
+	fftw_plan backward;
+	Vector_cd in;
+	Vector_cd out;
+	Vector_cd a_q;
+	Matrix_d tmp;
+	Matrix_d pair;
+	std::vector<int> neighbours[4]; // +x, -x, +y, -y
+
+	int coordinate (int x, int d) const {
+		switch (d) {
+			case 0: return (x/Lz/Ly)%Lx;
+			case 1: return (x/Lz)%Ly;
+			default: return x%Lz;
+		}
+	}
+
+	int site (int a, int b, int c) const {
+		return ((a+Lx)%Lx)*Ly*Lz + ((b+Ly)%Ly)*Lz + (c+Lz)%Lz;
+	}
+
+	int neighbour (int x, int d, int k) const {
+		int c[] = { coordinate(x, 0), coordinate(x, 1), coordinate(x, 2) };
+		c[d] += k;
+		return site(c[0], c[1], c[2]);
+	}
+
+	public:
+
+	// index of the displacement x-y
+	int displacement (int x, int y) const {
+		return site(coordinate(x, 0)-coordinate(y, 0), coordinate(x, 1)-coordinate(y, 1), coordinate(x, 2)-coordinate(y, 2));
+	}
+
+	void setup (int lx, int ly, int lz) {
+		release();
+		Lx = lx;
+		Ly = ly;
+		Lz = lz;
+		V = Lx*Ly*Lz;
+		int E = 3;
+		if (Lz<2) E = 2;
+		if (Lz<2 && Ly<2) E = 1;
+		const int size[] = { Lx, Ly, Lz, };
+		in.setZero(V);
+		out.setZero(V);
+		for (int n=0;n<4;n++) {
+			neighbours[n].resize(V);
+			for (int x=0;x<V;x++) neighbours[n][x] = neighbour(x, n/2, n%2?-1:+1);
+		}
+		forward = fftw_plan_dft(E, size, reinterpret_cast<fftw_complex*>(in.data()),
+				reinterpret_cast<fftw_complex*>(out.data()), FFTW_FORWARD, FFTW_ESTIMATE);
+		backward = fftw_plan_dft(E, size, reinterpret_cast<fftw_complex*>(out.data()),
+				reinterpret_cast<fftw_complex*>(in.data()), FFTW_BACKWARD, FFTW_ESTIMATE);
+	}
+
+	// c(r) = 1/V sum_x a(x+r) b(x)
+	void correlate (const Vector_d &a, const Vector_d &b, Eigen::ArrayXd &c) {
+		in = a.cast<Complex>();
+		fftw_execute(forward);
+		a_q = out;
+		in = b.cast<Complex>();
+		fftw_execute(forward);
+		out = a_q.cwiseProduct(out.conjugate())/double(V*V);
+		fftw_execute(backward);
+		c = in.real().array();
+	}
+
+	// c(r) = 1/V sum_x A(x+r, x)
+	void translation_sum (const Matrix_d &A, Eigen::ArrayXd &c) const {
+		c.setZero(V);
+		for (int y=0;y<V;y++) {
+			for (int x=0;x<V;x++) c[displacement(x, y)] += A(x, y);
+		}
+		c /= double(V);
+	}
+
+	// S(q) = sum_r exp(-iqr) c(r), real for the symmetric correlations measured here
+	void structure_factor (const Eigen::ArrayXd &c, Eigen::ArrayXd &s) {
+		in = c.matrix().cast<Complex>();
+		fftw_execute(forward);
+		s = out.real().array();
+	}
+
+	// <S^z_{x+r} S^z_x> and <n_{x+r} n_x> averaged over x, for the density
+	// matrices rho_ij = <c^dagger_i c_j> of the two spin species
+	void spin_density (const Matrix_d &rho_up, const Matrix_d &rho_dn, Eigen::ArrayXd &spin, Eigen::ArrayXd &density) {
+		Eigen::ArrayXd exchange, local;
+		tmp = rho_up.cwiseProduct(rho_up.transpose()) + rho_dn.cwiseProduct(rho_dn.transpose());
+		translation_sum(tmp, exchange);
+		exchange[0] -= (rho_up.diagonal()+rho_dn.diagonal()).sum()/V;
+		correlate(rho_up.diagonal()-rho_dn.diagonal(), rho_up.diagonal()-rho_dn.diagonal(), local);
+		spin = 0.25*(local-exchange);
+		correlate(rho_up.diagonal()+rho_dn.diagonal(), rho_up.diagonal()+rho_dn.diagonal(), local);
+		density = local-exchange;
+	}
+
+	// pair correlation with a d-wave form factor (+1 along x, -1 along y) on
+	// both ends, for all distances: rho_up(x, y) times the form factor
+	// applied to both indices of rho_dn, summed over translations
+	void d_wave (const Matrix_d &rho_up, const Matrix_d &rho_dn, Eigen::ArrayXd &c) {
+		pair.setZero(V, V);
+		for (int n=0;n<4;n++) {
+			const double f = n<2?1.0:-1.0;
+			for (int y=0;y<V;y++) {
+				for (int x=0;x<V;x++) pair(x, y) += f*rho_dn(neighbours[n][x], y);
+			}
+		}
+		tmp.setZero(V, V);
+		for (int n=0;n<4;n++) {
+			const double f = n<2?1.0:-1.0;
+			for (int y=0;y<V;y++) tmp.col(y) += f*pair.col(neighbours[n][y]);
+		}
+		tmp.array() *= rho_up.array();
+		translation_sum(tmp, c);
+	}
+
+	void release () {
+		if (V>0) {
+			fftw_destroy_plan(forward);
+			fftw_destroy_plan(backward);
+		}
+		V = 0;
+	}
+
+	CorrelationFunctions () : Lx(0), Ly(0), Lz(0), V(0) {}
+	CorrelationFunctions (const CorrelationFunctions &) = delete;
+	CorrelationFunctions& operator= (const CorrelationFunctions &) = delete;
+	~CorrelationFunctions () { release(); }
+};
+
+#endif // CORRELATIONS_HPP
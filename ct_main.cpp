@@ -82,7 +82,12 @@ void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic
 		CTSimulation simulation(L, -1);
 		lua_pop(L, 1);
 		if (!savefile.empty()) {
-			if (luaL_dofile(L, savefile.c_str())) {
+			const CheckpointStatus status = simulation.load_checkpoint(savefile, thermalization_sweeps, total_sweeps);
+			if (status==CheckpointLoaded) {
+				log << "loaded binary checkpoint" << savefile;
+			} else if (status==CheckpointDamaged) {
+				log << "could not load binary checkpoint" << savefile << "- starting from scratch";
+			} else if (luaL_dofile(L, savefile.c_str())) {
 				log << "error loading savefile:" << lua_tostring(L, -1);
 				lua_pop(L, 1);
 			} else {
@@ -95,21 +100,11 @@ void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic
 		}
 		//simulation.load_sigma(L, "nice.lua");
 		lock.unlock();
+		// binary checkpoints do not touch the Lua state, so no lock is needed
 		auto save_checkpoint = [&] (int thermalization, int sweeps) {
-			lock.lock();
-			simulation.save_checkpoint(L);
-			lua_pushinteger(L, thermalization);
-			lua_setfield(L, -2, "THERMALIZATION");
-			lua_pushinteger(L, sweeps);
-			lua_setfield(L, -2, "SWEEPS");
-			lua_pushstring(L, getenv("LSB_JOBID"));
-			lua_setfield(L, -2, "JOBID");
-			lua_getglobal(L, "serialize");
-			lua_insert(L, -2);
-			lua_pushstring(L, savefile.c_str());
-			lua_insert(L, -2);
-			lua_pcall(L, 2, 0, 0);
-			lock.unlock();
+			if (savefile.empty()) return;
+			const char *jobid = getenv("LSB_JOBID");
+			simulation.save_checkpoint(savefile, thermalization, sweeps, jobid?jobid:"");
 		};
 		save_checkpoint(thermalization_sweeps, total_sweeps);
 		try {
@@ -2,6 +2,8 @@
 #include "mpfr.hpp"
 
 #include "lua_tuple.hpp"
+#include "svd_tuner.hpp"
+#include "checkpoint.hpp"
 
 // FIXME only works in 2D
 void CTSimulation::prepare_open_boundaries () {
@@ -100,6 +102,28 @@ void CTSimulation::init () {
 	positionSpace.setIdentity(V, V);
 	momentumSpace.setIdentity(V, V);
 
+	svd.setMethod(decomposition);
+	svdA.setMethod(decomposition);
+	svdB.setMethod(decomposition);
+	svd_inverse.setMethod(decomposition);
+	svd_inverse_up.setMethod(decomposition);
+	svd_inverse_dn.setMethod(decomposition);
+
+	SVDHelper::Driver driver = SVDHelper::driverFromName(svd_driver);
+	if (svd_driver=="auto") {
+		SVDTuner tuner;
+		tuner.setSlices(N, msvd);
+		driver = tuner.tune(V);
+	}
+	svd.setDriver(driver);
+	svdA.setDriver(driver);
+	svdB.setDriver(driver);
+	svd_inverse.setDriver(driver);
+	svd_inverse_up.setDriver(driver);
+	svd_inverse_dn.setDriver(driver);
+
+	spin_tasks.setEnabled(parallel_spins);
+
 	prepare_propagators();
 	prepare_open_boundaries();
 
@@ -169,6 +193,17 @@ void CTSimulation::load (lua_State *L, int index) {
 	lua_getfield(L, index, "SVD");     msvd = lua_tointeger(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "flips_per_update");     flips_per_update = lua_tointeger(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "open_boundary");     open_boundary = lua_toboolean(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "decomposition");
+	if (lua_isstring(L, -1)) {
+		decomposition = std::string(lua_tostring(L, -1))=="udt"?SVDHelper::UDT:SVDHelper::SVD;
+	} else {
+		decomposition = SVD_DEFAULT_METHOD;
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, index, "svd_driver");
+	svd_driver = lua_isstring(L, -1)?lua_tostring(L, -1):"gesvd";
+	lua_pop(L, 1);
+	lua_getfield(L, index, "parallel_spins");     parallel_spins = lua_toboolean(L, -1);            lua_pop(L, 1);
 	//lua_getfield(L, index, "LOGFILE");  logfile.open(lua_tostring(L, -1));     lua_pop(L, 1);
 	init();
 }
@@ -198,6 +233,9 @@ void CTSimulation::save (lua_State *L, int index) {
 	lua_pushinteger(L, msvd); lua_setfield(L, index, "SVD");
 	lua_pushinteger(L, flips_per_update); lua_setfield(L, index, "flips_per_update");
 	lua_pushboolean(L, open_boundary?1:0); lua_setfield(L, index, "open_boundary");
+	lua_pushstring(L, decomposition==SVDHelper::UDT?"udt":"svd"); lua_setfield(L, index, "decomposition");
+	lua_pushstring(L, svd_driver.c_str()); lua_setfield(L, index, "svd_driver");
+	lua_pushboolean(L, parallel_spins?1:0); lua_setfield(L, index, "parallel_spins");
 	lua_newtable(L);
 	L << measurements.sign_measured;
 	lua_setfield(L, -2, "sign_measured");
@@ -319,6 +357,84 @@ void CTSimulation::save_checkpoint (lua_State *L) {
 	lua_setfield(L, -2, "sigma");
 }
 
+std::vector<std::pair<const char*, mymeasurement<double>*>> CTSimulation::checkpoint_measurements () {
+	return {
+		{ "sign_measured", &measurements.sign_measured },
+		{ "acceptance", &measurements.acceptance },
+		{ "density", &measurements.density },
+		{ "magnetization", &measurements.magnetization },
+		{ "order_parameter", &measurements.order_parameter },
+		{ "chi_af", &measurements.chi_af },
+		{ "exact_sign", &measurements.exact_sign },
+		{ "chi_d", &measurements.chi_d },
+	};
+}
+
+// binary counterpart of the Lua checkpoint, see Simulation::load_checkpoint.
+// The vertices are stored but, as with the Lua checkpoint, not restored yet
+CheckpointStatus CTSimulation::load_checkpoint (const std::string &fn, int &thermalization, int &sweeps) {
+	CheckpointReader in;
+	if (!in.open(fn)) return CheckpointNotBinary;
+	const std::string kind = in.read_string();
+	const int64_t therm = in.read<int64_t>();
+	const int64_t sw = in.read<int64_t>();
+	in.read_string(); // job id
+	const std::string seed = in.read_string();
+	const int64_t shift = in.read<int64_t>();
+	in.read<int64_t>(); // N
+	in.read<int64_t>(); // V
+	const int64_t vertices = in.read<int64_t>();
+	for (int64_t i=0;i<vertices && in.good();i++) {
+		int64_t n;
+		in.read<double>();
+		in.read_array(n);
+	}
+	std::vector<std::pair<std::string, mymeasurement<double>>> results;
+	const int64_t count = in.read<int64_t>();
+	for (int64_t i=0;i<count && in.good();i++) {
+		results.push_back(std::make_pair(std::string(), mymeasurement<double>()));
+		results.back().first = in.read(results.back().second);
+	}
+	if (!in.good() || kind!="CTSimulation") {
+		std::cerr << "damaged checkpoint " << fn << std::endl;
+		return CheckpointDamaged;
+	}
+	std::stringstream seed_in(seed);
+	seed_in >> generator;
+	time_shift = shift;
+	for (const auto &r : results) {
+		for (const auto &m : checkpoint_measurements()) {
+			if (r.first==m.first) *m.second = r.second;
+		}
+	}
+	thermalization = therm;
+	sweeps = sw;
+	return CheckpointLoaded;
+}
+
+bool CTSimulation::save_checkpoint (const std::string &fn, int thermalization, int sweeps, const std::string &jobid) {
+	CheckpointWriter out;
+	std::stringstream seed;
+	seed << generator;
+	out.write(std::string("CTSimulation"));
+	out.write(int64_t(thermalization));
+	out.write(int64_t(sweeps));
+	out.write(jobid);
+	out.write(seed.str());
+	out.write(int64_t(time_shift));
+	out.write(int64_t(N));
+	out.write(int64_t(V));
+	out.write(int64_t(diagonals.size()));
+	for (iter d=diagonals.begin();d!=diagonals.end();d++) {
+		out.write(d->first);
+		out.write(d->second.data(), d->second.size());
+	}
+	const auto list = checkpoint_measurements();
+	out.write(int64_t(list.size()));
+	for (const auto &m : list) out.write(m.first, *m.second);
+	return out.commit(fn);
+}
+
 std::pair<double, double> CTSimulation::rank1_probability (int x) {
 	int L = update_size;
 	int j;
@@ -605,56 +721,59 @@ void CTSimulation::write_green_function () {
 	}
 }
 
-void CTSimulation::propagate_svd (double dtau) {
+void CTSimulation::propagate_chain (SVDHelper &s, double dtau, double h) {
 	if (dtau>0.0) {
-		svdA.U.applyOnTheLeft(eigenvectors.transpose());
-		svdA.U.applyOnTheLeft((-dtau*(energies-mu-0.5*B)).exp().matrix().asDiagonal());
-		svdA.U.applyOnTheLeft(eigenvectors);
-		svdB.U.applyOnTheLeft(eigenvectors.transpose());
-		svdB.U.applyOnTheLeft((-dtau*(energies-mu+0.5*B)).exp().matrix().asDiagonal());
-		svdB.U.applyOnTheLeft(eigenvectors);
+		s.U.applyOnTheLeft(eigenvectors.transpose());
+		s.U.applyOnTheLeft((-dtau*(energies-mu+h)).exp().matrix().asDiagonal());
+		s.U.applyOnTheLeft(eigenvectors);
 	}
 }
 
-void CTSimulation::make_svd_double (double t0) {
+void CTSimulation::propagate_svd (double dtau) {
+	propagate_chain(svdA, dtau, -0.5*B);
+	propagate_chain(svdB, dtau, +0.5*B);
+}
+
+// one spin species: h is the Zeeman term, sigma the sign of the auxiliary field
+void CTSimulation::make_svd_chain (SVDHelper &s, double t0, double h, double sigma) {
 	double dBeta = beta/(config.nsvd+1);
-	svdA.setIdentity(V);
-	svdB.setIdentity(V);
+	s.setIdentity(V);
 	double t1 = t0;
 	double dtau;
 	while (t1<beta) {
 		double start = t1, end = std::min(beta, t1+dBeta);
 		for (iter i=diagonals.lower_bound(start);i!=diagonals.lower_bound(end);i++) {
 			dtau = i->first-t1;
-			propagate_svd(dtau);
-			svdA.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+i->second).array()).matrix().asDiagonal());
-			svdB.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)-i->second).array()).matrix().asDiagonal());
+			propagate_chain(s, dtau, h);
+			s.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+sigma*i->second).array()).matrix().asDiagonal());
 			t1 = i->first;
 		}
 		dtau = end-t1;
-		propagate_svd(dtau);
+		propagate_chain(s, dtau, h);
 		t1 = end;
-		svdA.absorbU();
-		svdB.absorbU();
+		s.absorbU();
 	}
 	t1 = 0.0;
 	while (t1<t0) {
 		double start = t1, end = std::min(t0, t1+dBeta);
 		for (iter i=diagonals.lower_bound(start);i!=diagonals.lower_bound(end);i++) {
 			dtau = i->first-t1;
-			propagate_svd(dtau);
-			svdA.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+i->second).array()).matrix().asDiagonal());
-			svdB.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)-i->second).array()).matrix().asDiagonal());
+			propagate_chain(s, dtau, h);
+			s.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+sigma*i->second).array()).matrix().asDiagonal());
 			t1 = i->first;
 		}
 		dtau = end-t1;
-		propagate_svd(dtau);
+		propagate_chain(s, dtau, h);
 		t1 = end;
-		svdA.absorbU();
-		svdB.absorbU();
+		s.absorbU();
 	}
 }
 
+void CTSimulation::make_svd_double (double t0) {
+	spin_tasks.run([this, t0] () { make_svd_chain(svdA, t0, -0.5*B, +1.0); },
+			[this, t0] () { make_svd_chain(svdB, t0, +0.5*B, -1.0); });
+}
+
 void CTSimulation::collect_measurements () {
 	measurements.discard();
 }
@@ -6,6 +6,8 @@
 #include "svd.hpp"
 #include "types.hpp"
 #include "measurements.hpp"
+#include "spin_tasks.hpp"
+#include "checkpoint.hpp"
 
 #include <fstream>
 #include <random>
@@ -144,6 +146,10 @@ class CTSimulation {
 	int msvd;
 	int flips_per_update;
 	bool open_boundary;
+	SVDHelper::Method decomposition;
+	std::string svd_driver;
+	bool parallel_spins; // run the spin up and down chains on two threads
+	SpinTasks spin_tasks;
 
 
 	// RNG distributions
@@ -294,6 +300,9 @@ class CTSimulation {
 	void save (lua_State *L, int index);
 	void load_checkpoint (lua_State *L);
 	void save_checkpoint (lua_State *L);
+	CheckpointStatus load_checkpoint (const std::string &fn, int &thermalization, int &sweeps);
+	bool save_checkpoint (const std::string &fn, int thermalization, int sweeps, const std::string &jobid);
+	std::vector<std::pair<const char*, mymeasurement<double>*>> checkpoint_measurements ();
 
 	CTSimulation (lua_State *L, int index) : coin_flip(0.5), trialDistribution(1.0), randomType(0, 1), histogram(2, 0), steps(0) {
 		load(L, index);
@@ -310,7 +319,9 @@ class CTSimulation {
 	void make_svd () {
 	}
 
+	void propagate_chain (SVDHelper &s, double dtau, double h);
 	void propagate_svd (double dtau);
+	void make_svd_chain (SVDHelper &s, double t0, double h, double sigma);
 	void make_svd_double (double t0);
 
 	void make_density_matrices () {
@@ -320,12 +331,15 @@ class CTSimulation {
 
 	void make_svd_inverse (double t0) {
 		make_svd_double(t0);
-		svdA.add_identity(1.0);
-		svdB.add_identity(1.0);
-		svd_inverse_up = svdA;
-		svd_inverse_up.invertInPlace();
-		svd_inverse_dn = svdB;
-		svd_inverse_dn.invertInPlace();
+		spin_tasks.run([this] () {
+			svdA.add_identity(1.0);
+			svd_inverse_up = svdA;
+			svd_inverse_up.invertInPlace();
+		}, [this] () {
+			svdB.add_identity(1.0);
+			svd_inverse_dn = svdB;
+			svd_inverse_dn.invertInPlace();
+		});
 		if (diagonals.find(t0)!=diagonals.end()) {
 			update_matrix_up = -svd_inverse_up.matrix();
 			update_matrix_up.diagonal() += Vector_d::Ones(V);
@@ -345,7 +359,7 @@ class CTSimulation {
 	}
 
 	double svd_sign () {
-		return (svdA.U*svdA.Vt*svdB.U*svdB.Vt).determinant()>0.0?1.0:-1.0;
+		return svdA.sign()*svdB.sign();
 	}
 
 	void compute_uv_f_short (int x, int t) {
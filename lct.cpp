@@ -8,6 +8,8 @@
 #include "svd.hpp"
 
 #include "accumulator.hpp"
+#include "vertex_store.hpp"
+#include "v3_common.hpp"
 #include "hubbard.hpp"
 
 
@@ -67,6 +69,8 @@ std::ostream & operator<< (std::ostream &out, const Vertex& v) {
 	return out;
 }
 
+typedef VertexStore<Vertex, Vertex::Compare, SlicePropagator> V3VertexStore;
+
 class V3Slice {
 	std::set<Vertex, Vertex::Compare> verts;
 
@@ -119,7 +123,7 @@ class V3Slice {
 };
 
 class V3Configuration {
-	std::set<Vertex, Vertex::Compare> verts;
+	V3VertexStore verts;
 
 	Eigen::MatrixXd eigenvectors;
 	Eigen::VectorXd eigenvalues;
@@ -129,14 +133,24 @@ class V3Configuration {
 
 	std::vector<Eigen::MatrixXd> slices_up;
 	std::vector<Eigen::MatrixXd> slices_dn;
-	std::vector<int> damage;
+	std::vector<int> damage; // rank-1 changes since the slice was last rebuilt
+	std::vector<size_t> versions; // bumped on every change of a slice matrix
+
+	int damage_threshold; // rebuild a slice instead of its next rank-1 change
+	SliceDrift drift;
 
 	public:
 
-	const std::set<Vertex, Vertex::Compare>& vertices () const { return verts; }
-	std::set<Vertex, Vertex::Compare>& vertices () { return verts; }
+	V3Configuration () : V(0), beta(1.0), mu(0.0), B(0.0), damage_threshold(10) {}
 
-	void setBeta (double b) { beta = b; verts.erase(verts.lower_bound(Vertex(b, 0, 0)), verts.end());}
+	const V3VertexStore& vertices () const { return verts; }
+	V3VertexStore& vertices () { return verts; }
+
+	void setBeta (double b) {
+		beta = b;
+		verts.erase(verts.lower_bound(Vertex(b, 0, 0)), verts.end());
+		verts.setup(beta, slices_up.size());
+	}
 	void setMu (double m) { mu = m; }
 	void setB (double b) { B = b; }
 
@@ -150,6 +164,7 @@ class V3Configuration {
 		void setEigenvalues (const Eigen::MatrixBase<M> &E) {
 			eigenvalues = E;
 			V = E.size();
+			verts.setCache(SlicePropagator(eigenvalues.array()));
 		}
 
 	size_t volume () const { return V; }
@@ -162,77 +177,11 @@ class V3Configuration {
 	Eigen::VectorXd cache;
 
 	void computeUpdateVectors (Eigen::VectorXd &u, Eigen::VectorXd &v, const Vertex& w, double s) {
-		size_t n = slices_up.size();
-		double dtau = beta/n;
-		size_t index = size_t(w.tau/dtau);
-		double t0 = beta/n*index, t1 = beta/n*(index+1);
-		auto first = verts.lower_bound(Vertex(t0, 0, 0));
-		auto last = verts.lower_bound(Vertex(t1, 0, 0));
-		auto now = verts.lower_bound(Vertex(w.tau, 0, 0));
-		u = eigenvectors.row(w.x).transpose();
-		v = eigenvectors.row(w.x).transpose();
-
-		double t = w.tau;
-		for (auto i=now;i!=last;) {
-			if (i->tau==w.tau) {
-				i++;
-				continue;
-			}
-			if (i->tau>t) {
-				u.array() *= (-(i->tau-t)*eigenvalues.array()).exp();
-				t = i->tau;
-			}
-			//auto j = i;
-			//while (++j!=last && j->tau==t) {}
-			//if (std::distance(i, j)==1) {
-				u += s * i->sigma * eigenvectors.row(i->x).transpose() * (eigenvectors.row(i->x) * u);
-			//} else {
-				//cache.setZero(V);
-				//for (auto k=i;k!=j;k++) {
-					//cache += s * k->sigma * eigenvectors.row(k->x).transpose() * (eigenvectors.row(k->x) * u);
-				//}
-				//u += cache;
-			//}
-			++i;
-		}
-		if (t1>t) {
-			u.array() *= (-(t1-t)*eigenvalues.array()).exp();
-		}
-
-		t = w.tau;
-		for (auto i=now;first!=verts.end();) {
-			if (i!=verts.end() && i->tau<t) {
-				v.array() *= (-(t-i->tau)*eigenvalues.array()).exp();
-				t = i->tau;
-			}
-			auto j = i;
-			while (j!=first && std::prev(j)->tau==t) { j--; }
-			if (std::distance(j, i)==0 && t<w.tau) {
-				v += s * i->sigma * eigenvectors.row(i->x).transpose() * (eigenvectors.row(i->x) * v);
-			} else if (t!=w.tau) {
-				cache.setZero(V);
-				for (auto k=i;std::prev(k)!=j;k--) {
-					cache += s * k->sigma * eigenvectors.row(k->x).transpose() * (eigenvectors.row(k->x) * v);
-				}
-				v += cache;
-			}
-			if (j==first) {
-				break;
-			} else {
-				i = std::prev(j);
-			}
-		}
-		if (t0<t) {
-			v.array() *= (-(t-t0)*eigenvalues.array()).exp();
-		}
-
-		u *= s * w.sigma;
+		slice_update_vectors(verts, eigenvectors, beta, slices_up.size(), w, s, u, v, cache);
 	}
 
 	void addRank1Vertex (const Vertex& w) {
-		size_t n = slices_up.size();
-		double dtau = beta/n;
-		size_t index = size_t(w.tau/dtau);
+		size_t index = verts.slice_of(w.tau);
 		Eigen::VectorXd u_up, v_up;
 		Eigen::VectorXd u_dn, v_dn;
 		computeUpdateVectors(u_up, v_up, w, 1.0);
@@ -268,6 +217,8 @@ class V3Configuration {
 		slices_up[index] += u_up * v_up.transpose();
 		slices_dn[index] += u_dn * v_dn.transpose();
 		damage[index]++;
+		versions[index]++;
+		check_drift(index);
 	}
 
 	void computeReversedVector (Eigen::VectorXd &v, const Vertex& w, double s) {
@@ -281,6 +232,8 @@ class V3Configuration {
 		auto now = verts.lower_bound(Vertex(w.tau, 0, 0));
 		v = eigenvectors.row(w.x).transpose();
 		Eigen::VectorXd cache;
+		const SlicePropagator::value_type own = verts.cache_at(w.tau);
+		const Eigen::ArrayXd *back = &own.backward;
 
 		double t = w.tau;
 		for (auto i=now;i!=first&&std::prev(i)!=first;) {
@@ -289,13 +242,14 @@ class V3Configuration {
 				continue;
 			}
 			if (i->tau<t) {
-				v.array() *= (+(t-i->tau)*eigenvalues.array()).exp();
+				v.array() *= *back * i.cached().forward;
+				back = &i.cached().backward;
 				t = i->tau;
 			}
 			v -= s * i->sigma / (1.0+s*i->sigma) * eigenvectors.row(i->x).transpose() * (eigenvectors.row(i->x) * v);
 		}
 		if (t0<t) {
-			v.array() *= (+(t-t0)*eigenvalues.array()).exp();
+			v.array() *= *back;
 		}
 		v *= s * w.sigma;
 		Eigen::VectorXd u, r, z;
@@ -313,14 +267,15 @@ class V3Configuration {
 		//throw;
 	}
 
-	void addVertex (const Vertex& w, int threshold = 10) {
-		size_t n = slices_up.size();
-		double dtau = beta/n;
-		size_t index = size_t(w.tau/dtau);
-		//addRank1Vertex(w);
-		insertVertex(w);
-		return;
-		if (damage[index]<threshold) {
+	// the slice matrices follow insertions and removals with rank-1 changes
+	// until damage_threshold of them have piled up, then they are rebuilt
+	void addVertex (const Vertex& w) {
+		if (slices_up.empty()) {
+			insertVertex(w);
+			return;
+		}
+		size_t index = verts.slice_of(w.tau);
+		if (damage[index]<damage_threshold) {
 			addRank1Vertex(w);
 		} else {
 			insertVertex(w);
@@ -328,14 +283,21 @@ class V3Configuration {
 		}
 	}
 
-	void compute_slice (Eigen::MatrixXd &G, double a, double b, double s) const {
+	// applies slice index to G, the gaps use the cached exponentials of the
+	// vertices and back = exp(+(t-t0)*E) is left out while t is still t0
+	void compute_slice (Eigen::MatrixXd &G, size_t index, double s) const {
+		size_t n = slices_up.size();
+		double a = beta/n*index, b = beta/n*(index+1);
 		auto first = verts.lower_bound(Vertex(a, 0, 0));
 		auto last = verts.lower_bound(Vertex(b, 0, 0));
 		double t = a;
+		const Eigen::ArrayXd *back = nullptr;
 		Eigen::MatrixXd cache;
 		for (auto v=first;v!=last;) {
 			if (v->tau>t) {
-				G.array().colwise() *= (-(v->tau-t)*eigenvalues.array()).exp();
+				if (back) G.array().colwise() *= v.cached().forward * *back;
+				else G.array().colwise() *= v.cached().forward;
+				back = &v.cached().backward;
 				t = v->tau;
 			}
 			auto w = v;
@@ -353,20 +315,26 @@ class V3Configuration {
 			//std::cerr << "vertex!" << std::endl;
 		}
 		if (b>t) {
-			G.array().colwise() *= (-(b-t)*eigenvalues.array()).exp();
+			if (back) G.array().colwise() *= verts.slice_cache().forward * *back;
+			else G.array().colwise() *= verts.slice_cache().forward;
 		}
 		//std::cerr << (-(b-t)*eigenvalues.array()).exp().transpose() << std::endl << std::endl;
 		//std::cerr << G << std::endl << std::endl;
 	}
 
-	void compute_slice_inverse (Eigen::MatrixXd &G, double a, double b, double s) {
+	void compute_slice_inverse (Eigen::MatrixXd &G, size_t index, double s) {
+		size_t n = slices_up.size();
+		double a = beta/n*index, b = beta/n*(index+1);
 		auto first = verts.lower_bound(Vertex(a, 0, 0));
 		auto last = verts.lower_bound(Vertex(b, 0, 0));
 		double t = a;
+		const Eigen::ArrayXd *fwd = nullptr;
 		Eigen::MatrixXd cache;
 		for (auto v=first;v!=last;) {
 			if (v->tau>t) {
-				G.array().rowwise() *= (+(v->tau-t)*eigenvalues.array()).exp().transpose();
+				if (fwd) G.array().rowwise() *= (v.cached().backward * *fwd).transpose();
+				else G.array().rowwise() *= v.cached().backward.transpose();
+				fwd = &v.cached().forward;
 				t = v->tau;
 			}
 			auto w = v;
@@ -384,41 +352,56 @@ class V3Configuration {
 			//std::cerr << "vertex!" << std::endl;
 		}
 		if (b>t) {
-			G.array().rowwise() *= (+(b-t)*eigenvalues.array()).exp().transpose();
+			if (fwd) G.array().rowwise() *= (verts.slice_cache().backward * *fwd).transpose();
+			else G.array().rowwise() *= verts.slice_cache().backward.transpose();
 		}
 		//std::cerr << (-(b-t)*eigenvalues.array()).exp().transpose() << std::endl << std::endl;
 		//std::cerr << G << std::endl << std::endl;
 	}
 
 	size_t sliceSize (size_t i) const {
-		size_t n = slices_up.size();
-		auto first = verts.lower_bound(Vertex(beta/n*i, 0, 0));
-		auto last = verts.lower_bound(Vertex(beta/n*(i+1), 0, 0));
-		return std::distance(first, last);
+		return verts.slice_size(i);
 	}
 
 	void reset_slice (size_t index) {
-		size_t n = slices_up.size();
 		slices_up[index].setIdentity(V, V);
 		slices_dn[index].setIdentity(V, V);
-		compute_slice(slices_up[index], beta/n*index, beta/n*(index+1), +1.0);
-		compute_slice(slices_dn[index], beta/n*index, beta/n*(index+1), -1.0);
+		compute_slice(slices_up[index], index, +1.0);
+		compute_slice(slices_dn[index], index, -1.0);
 		damage[index] = 0;
+		versions[index]++;
 	}
 
-	void recheck_slice (size_t index) {
-		if (index<0 || index>=damage.size() || damage[index]==0) return;
-		int d = damage[index];
+	// relative deviation of the maintained matrices of a slice from a
+	// rebuild, which then replaces them
+	double slice_drift (size_t index) {
 		Eigen::MatrixXd A = slices_up[index];
 		Eigen::MatrixXd B = slices_dn[index];
 		reset_slice(index);
-		std::cerr << index << " (damage=" << d << ") " <<(A - slices_up[index]).norm() << ' ' << (B - slices_dn[index]).norm() << std::endl;
+		return drift.record(A, B, slices_up[index], slices_dn[index]);
 	}
 
+	void check_drift (size_t index) {
+		if (drift.due()) drift.adapt(index, slice_drift(index), damage_threshold);
+	}
+
+	void recheck_slice (size_t index) {
+		if (index>=damage.size() || damage[index]==0) return;
+		int d = damage[index];
+		std::cerr << index << " (damage=" << d << ") " << slice_drift(index) << std::endl;
+	}
+
+	void setDamageThreshold (int n) { damage_threshold = n; }
+	void setDriftCheck (size_t interval, double tolerance) { drift.interval = interval; drift.tolerance = tolerance; }
+	size_t driftChecks () const { return drift.checks; }
+	double maxDrift () const { return drift.max; }
+
 	void make_slices (size_t n) {
+		verts.setup(beta, n);
 		slices_up.resize(n);
 		slices_dn.resize(n);
 		damage.resize(n);
+		versions.resize(n);
 		for (size_t i=0;i<n;i++) {
 			reset_slice(i);
 		}
@@ -436,6 +419,10 @@ class V3Configuration {
 		return slices_dn[i];
 	}
 
+	size_t sliceVersion (size_t i) const {
+		return versions[i];
+	}
+
 	double inverseTemperature () const { return beta; }
 	double chemicalPotential () const { return mu; }
 	double magneticField () const { return B; }
@@ -443,26 +430,29 @@ class V3Configuration {
 	double mu_dn () const { return mu-0.5*B; }
 	size_t verticesNumber () const { return verts.size(); }
 
-	std::set<Vertex>::iterator pickVertexIterator (size_t slice, size_t index) const {
-		size_t n = slices_up.size();
-		auto first = verts.lower_bound(Vertex(beta/n*slice, 0, 0));
-		auto last = verts.lower_bound(Vertex(beta/n*(slice+1), 0, 0));
-		for (auto i=first;i!=last;i++) {
-			if (index==0) return i;
-			index--;
-		}
-		return last;
+	V3VertexStore::const_iterator pickVertexIterator (size_t slice, size_t index) const {
+		return verts.pick(slice, index);
 	}
 
+	// the update vectors of a vertex still in the slice skip it, so
+	// subtracting their product takes it out of the slice matrices
 	void removeVertex (size_t slice, size_t index) {
 		auto i = pickVertexIterator(slice, index);
-		//Eigen::VectorXd u_up, v_up;
-		//Eigen::VectorXd u_dn, v_dn;
-		//computeUpdateVectors(u_up, v_up, *i, 1.0);
-		//computeUpdateVectors(u_dn, v_dn, *i, -1.0);
-		//slices_up[slice] -= u_up*v_up.transpose();
-		//slices_dn[slice] -= u_dn*v_dn.transpose();
-		verts.erase(i);
+		if (damage[slice]<damage_threshold) {
+			Eigen::VectorXd u_up, v_up;
+			Eigen::VectorXd u_dn, v_dn;
+			computeUpdateVectors(u_up, v_up, *i, 1.0);
+			computeUpdateVectors(u_dn, v_dn, *i, -1.0);
+			slices_up[slice] -= u_up*v_up.transpose();
+			slices_dn[slice] -= u_dn*v_dn.transpose();
+			damage[slice]++;
+			versions[slice]++;
+			verts.erase(i);
+			check_drift(slice);
+		} else {
+			verts.erase(i);
+			reset_slice(slice);
+		}
 	}
 
 	Vertex pickVertex (size_t slice, size_t index) const {
@@ -524,6 +514,8 @@ class V3Probability {
 
 		Eigen::ArrayXd Rd;
 		Eigen::MatrixXd R, R_inverse;
+
+		SliceStack stack;
 	public:
 		void prepare_random_matrix (const V3Configuration& conf) {
 			Rd = 1.0*Eigen::ArrayXd::Random(conf.volume());
@@ -572,8 +564,7 @@ class V3Probability {
 			G_dn.Vt.applyOnTheRight(R_inverse);
 		}
 
-		void prepareUpdateMatrices (V3Configuration &conf, size_t index) {
-			conf.reset_slice(index);
+		void prepareUpdateMatrices (const V3Configuration &conf, size_t index) {
 			update_matrix_up = G_up.matrix(); // * conf.slice_up(index).inverse();
 			update_matrix_up.applyOnTheRight(conf.slice_up(index).inverse());
 			update_matrix_dn = G_dn.matrix(); // * conf.slice_up(index).inverse();
@@ -588,21 +579,21 @@ class V3Probability {
 			A_dn.add_identity(exp(beta*conf.mu_dn()));
 			std::pair<double, double> ret;
 			ret.first = A_up.S.array().log().sum() + A_dn.S.array().log().sum();
-			ret.second = (A_up.U*A_up.Vt*A_dn.U*A_dn.Vt).determinant()>0.0?1.0:-1.0;
-			if ((A_up.U*A_up.Vt).determinant()<0.0 || (A_dn.U*A_dn.Vt).determinant()<0.0) {
+			ret.second = A_up.sign()*A_dn.sign();
+			if (A_up.sign()<0.0 || A_dn.sign()<0.0) {
 				debug << "WTF?" << ret.second;
 				throw -1;
 			}
 			return ret;
 		}
 
-		void evolve (Accumulator &acc, const V3Configuration &conf, double t, double dtau) {
+		void evolve (Accumulator &acc, const V3Configuration &conf, double t) {
 			while (t>0.0) {
-				double step = std::min(t, dtau-acc.distance());
+				double step = std::min(t, acc.interval()-acc.distance());
 				acc.matrixU().array().colwise() *= (-step*conf.eigenValues().array()).exp();
 				acc.increase_distance(step);
 				t -= step;
-				if (acc.distance()>=dtau) acc.decomposeU();
+				if (acc.distance()>=acc.interval()) acc.decomposeU();
 			}
 		}
 
@@ -614,13 +605,14 @@ class V3Probability {
 			acc.SVD().U = conf.eigenVectors().transpose();
 			acc.SVD().S = Rd.exp();
 			acc.SVD().Vt = conf.eigenVectors();
-			double dtau = 1.0/3.0;
+			acc.SVD().resetSigns();
+			acc.schedule().start(StabilizationSchedule::spread(acc.SVD().S));
 			auto first = conf.vertices().lower_bound(Vertex(t0, 0, 0));
 			auto last = conf.vertices().lower_bound(Vertex(conf.inverseTemperature(), 0, 0));
 			int nv = 0;
 			double t = t0;
 			for (auto v=first;v!=last;v++) {
-				evolve(acc, conf, v->tau-t, dtau);
+				evolve(acc, conf, v->tau-t);
 				t = v->tau;
 				acc.matrixU() += s * v->sigma * conf.eigenVectors().row(v->x).transpose() * (conf.eigenVectors().row(v->x) * acc.matrixU());
 				acc.increase_logdet(std::log(std::fabs(1.0+s*v->sigma)));
@@ -632,13 +624,13 @@ class V3Probability {
 					nv = 0;
 				}
 			}
-			evolve(acc, conf, conf.inverseTemperature()-t, dtau);
+			evolve(acc, conf, conf.inverseTemperature()-t);
 			// wrap around
 			last = first;
 			first = conf.vertices().begin();
 			t = 0;
 			for (auto v=first;v!=last;v++) {
-				evolve(acc, conf, v->tau-t, dtau);
+				evolve(acc, conf, v->tau-t);
 				t = v->tau;
 				acc.matrixU() += s * v->sigma * conf.eigenVectors().row(v->x).transpose() * (conf.eigenVectors().row(v->x) * acc.matrixU());
 				acc.increase_logdet(std::log(std::fabs(1.0+s*v->sigma)));
@@ -650,7 +642,7 @@ class V3Probability {
 					nv = 0;
 				}
 			}
-			evolve(acc, conf, t0-t, dtau);
+			evolve(acc, conf, t0-t);
 			acc.matrixU().applyOnTheLeft(R_inverse);
 			acc.decomposeU();
 			acc_up.assertLogDet();
@@ -658,12 +650,40 @@ class V3Probability {
 			//std::cerr << G << std::endl << std::endl;
 		}
 
+		void setAdaptiveStabilization (bool a) {
+			acc_up.schedule().setAdaptive(a);
+			acc_dn.schedule().setAdaptive(a);
+		}
+
+		void reportStabilizations (std::ostream &out) const {
+			acc_up.schedule().report(out);
+			stack.report(out);
+		}
+
+		void setStackCheck (size_t interval, double tolerance) {
+			stack.check_interval = interval;
+			stack.tolerance = tolerance;
+		}
+
+		void collect_stack (const V3Configuration &conf, size_t index) {
+			stack.collect(conf, index, R, R_inverse, svd_up);
+		}
+
+		// the product of the slices starting at index comes from the slice
+		// stack, and every stack.check_interval uses from the vertices instead;
+		// if the two disagree the stack is rebuilt on the next use
 		void collect_alt (const V3Configuration &conf, size_t index) {
 			//double beta = conf.inverseTemperature();
 			//double mu = conf.chemicalPotential();
 			double t0 = conf.inverseTemperature()/conf.sliceNumber()*index;
 			if (R.rows()!=R.cols() || R.rows()!=int(conf.volume())) {
 				prepare_random_matrix(conf);
+				stack.invalidate();
+			}
+			if (!stack.check_due()) {
+				collect_stack(conf, index);
+				svd_dn = svd_up;
+				return;
 			}
 			accumulate(acc_up, conf, t0, +1.0);
 			//accumulate(acc_dn, conf, t0, -1.0);
@@ -673,6 +693,9 @@ class V3Probability {
 			//} catch (Accumulator::AssertionFailed ass) {
 			//}
 			//acc_dn.assertLogDet();
+			collect_stack(conf, index);
+			double d = green_distance(svd_up, acc_up.SVD(), std::exp(-conf.inverseTemperature()*conf.mu_up()));
+			stack.record(d);
 			svd_up = acc_up.SVD();
 			svd_dn = acc_up.SVD();
 		}
@@ -716,8 +739,8 @@ class V3Probability {
 			A_dn.add_identity(exp(beta*conf.mu_dn()));
 			std::pair<double, double> ret;
 			ret.first = A_up.S.array().log().sum() + A_dn.S.array().log().sum();
-			ret.second = (A_up.U*A_up.Vt*A_dn.U*A_dn.Vt).determinant()>0.0?1.0:-1.0;
-			if ((A_up.U*A_up.Vt).determinant()<0.0 || (A_dn.U*A_dn.Vt).determinant()<0.0) {
+			ret.second = A_up.sign()*A_dn.sign();
+			if (A_up.sign()<0.0 || A_dn.sign()<0.0) {
 				//debug << (A_up.U*A_up.Vt).determinant() << (A_dn.U*A_dn.Vt).determinant() << ret.second;
 				//throw -1;
 			}
@@ -783,6 +806,7 @@ class V3Updater {
 	Eigen::MatrixXd V_up, V_dn;
 	Eigen::VectorXd u_up, u_dn;
 	Eigen::VectorXd v_up, v_dn;
+	V3PendingBlock block_up, block_dn;
 
 	std::ofstream dump;
 
@@ -828,6 +852,8 @@ class V3Updater {
 		U_dn.resize(v, v);
 		V_up.resize(v, v);
 		V_dn.resize(v, v);
+		block_up.resize(v);
+		block_dn.resize(v);
 	}
 
 	void setSliceNumber (size_t n) {
@@ -901,11 +927,10 @@ class V3Updater {
 		U_dn.col(updates) = u_dn;
 		V_up.col(updates) = v_up;
 		V_dn.col(updates) = v_dn;
-		double d1, d2;
-		d1 = (Eigen::MatrixXd::Identity(updates+1, updates+1) + V_up.leftCols(updates+1).transpose() * prob.updateMatrixUp() * U_up.leftCols(updates+1)).determinant();
-		d2 = (Eigen::MatrixXd::Identity(updates+1, updates+1) + V_dn.leftCols(updates+1).transpose() * prob.updateMatrixDn() * U_dn.leftCols(updates+1)).determinant();
-		double new_p = std::log(std::fabs(d1)) + std::log(std::fabs(d2));
-		double new_s = d1*d2<0.0?-1.0:1.0;
+		double d1 = block_up.propose(prob.updateMatrixUp(), U_up, V_up, updates);
+		double d2 = block_dn.propose(prob.updateMatrixDn(), U_dn, V_dn, updates);
+		double new_p = update_p.first + std::log(std::fabs(d1)) + std::log(std::fabs(d2));
+		double new_s = d1*d2<0.0?-update_p.second:update_p.second;
 
 		bool ret = -trialDistribution(generator)<new_p-update_p.first+log(conf.inverseTemperature()/conf.sliceNumber())-log(conf.sliceSize(slice)+1)+std::log(K*conf.volume());
 		//std::cerr << new_p-update_p.first+log(conf.inverseTemperature())-log(conf.sliceSize(slice)+1)+log(K) << endl;
@@ -913,6 +938,8 @@ class V3Updater {
 			if (dump.is_open()) last_add.push_back(v);
 			conf.addVertex(v);
 			update_p = std::pair<double, double>(new_p, new_s);
+			block_up.accept(updates);
+			block_dn.accept(updates);
 			updates++;
 			//flush_updates(conf, prob);
 		} else {
@@ -980,11 +1007,10 @@ class V3Updater {
 		U_dn.col(updates) = -u_dn;
 		V_up.col(updates) = v_up;
 		V_dn.col(updates) = v_dn;
-		double d1, d2;
-		d1 = (Eigen::MatrixXd::Identity(updates+1, updates+1) + V_up.leftCols(updates+1).transpose() * prob.updateMatrixUp() * U_up.leftCols(updates+1)).determinant();
-		d2 = (Eigen::MatrixXd::Identity(updates+1, updates+1) + V_dn.leftCols(updates+1).transpose() * prob.updateMatrixDn() * U_dn.leftCols(updates+1)).determinant();
-		double new_p = std::log(std::fabs(d1)) + std::log(std::fabs(d2));
-		double new_s = d1*d2<0.0?-1.0:1.0;
+		double d1 = block_up.propose(prob.updateMatrixUp(), U_up, V_up, updates);
+		double d2 = block_dn.propose(prob.updateMatrixDn(), U_dn, V_dn, updates);
+		double new_p = update_p.first + std::log(std::fabs(d1)) + std::log(std::fabs(d2));
+		double new_s = d1*d2<0.0?-update_p.second:update_p.second;
 
 		bool ret = -trialDistribution(generator)<new_p-update_p.first-log(conf.inverseTemperature()/conf.sliceNumber())+log(conf.sliceSize(slice))-std::log(K*conf.volume());
 		//std::cerr << new_p-update_p.first-log(conf.inverseTemperature())+log(conf.verticesNumber()+1)-log(K) << endl;
@@ -992,6 +1018,8 @@ class V3Updater {
 			if (dump.is_open()) last_del.push_back(v);
 			conf.removeVertex(slice, vert_index);
 			update_p = std::pair<double, double>(new_p, new_s);
+			block_up.accept(updates);
+			block_dn.accept(updates);
 			updates++;
 			//flush_updates(conf, prob);
 		} else {
@@ -1153,13 +1181,20 @@ int main (int argc, char **argv) {
 	V3Updater updater;
 
 	if (argc<6) {
-		std::cerr << argv[0] << " $beta $mu $U $K $outfile" << std::endl;
+		std::cerr << argv[0] << " $beta $mu $U $K $outfile [$dumpfile] [--adaptive]" << std::endl;
 		return -1;
 	}
 
-	if (argc>6) {
-		updater.set_dump(argv[6]);
+	// --adaptive picks the stabilization interval from the growth of the scales
+	bool adaptive = false;
+	for (int i=6;i<argc;i++) {
+		if (string(argv[i])=="--adaptive") {
+			adaptive = true;
+		} else {
+			updater.set_dump(argv[i]);
+		}
 	}
+	prob.setAdaptiveStabilization(adaptive);
 
 	beta = atof(argv[1]);
 	mu = atof(argv[2]);
@@ -1211,6 +1246,7 @@ int main (int argc, char **argv) {
 			cerr << "SIGNAL 1" << endl;
 			cerr << "beta =" << configuration.inverseTemperature() << ' ' << n << " sweeps, " << configuration.verticesNumber() << " vertices" << endl;
 			cerr << "acceptance: " << a << endl;
+			prob.reportStabilizations(cerr);
 			if (n>=thermalization) measurements.report(std::cerr);
 			cerr << endl;
 		}
@@ -1250,6 +1286,7 @@ int main (int argc, char **argv) {
 			cerr << "SIGNAL 2" << endl;
 			cerr << "beta =" << configuration.inverseTemperature() << ' ' << n << " sweeps, " << configuration.verticesNumber() << " vertices" << endl;
 			cerr << "acceptance: " << a << endl;
+			prob.reportStabilizations(cerr);
 			if (n>=thermalization) measurements.report(std::cerr);
 			cerr << endl;
 			//configuration.printout("debug.state");
@@ -1261,6 +1298,7 @@ int main (int argc, char **argv) {
 	for (size_t k=0;k<configuration.sliceNumber();k++) {
 		configuration.recheck_slice(k);
 	}
+	cerr << "slice drift: " << configuration.maxDrift() << " at most in " << configuration.driftChecks() << " checks" << endl;
 	for (size_t k=0;k<configuration.sliceNumber();k++) {
 		debug << configuration.sliceSize(k);
 	}
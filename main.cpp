@@ -10,12 +10,16 @@
 #include <mutex>
 #include <atomic>
 #include <functional>
+#include <memory>
 
 #include "helpers.hpp"
 #include "measurements.hpp"
 #include "weighted_measurements.hpp"
 #include "logger.hpp"
 #include "svd.hpp"
+#include "checkpoint.hpp"
+#include "writer_thread.hpp"
+#include "replica_exchange.hpp"
 
 extern "C" {
 #include <fftw3.h>
@@ -58,7 +62,194 @@ void signal_handler (int signum) {
 }
 
 
-void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic<int> &current, std::atomic<int> &failed) {
+// chains of one task, only touched by the writer thread: every finished chain
+// is merged into the first one and the task is written once all are in
+struct ChainGroup {
+	int chains;
+	int finished;
+	double seconds;
+	std::shared_ptr<Simulation> result;
+
+	bool add (const std::shared_ptr<Simulation> &simulation, double t) {
+		finished++;
+		seconds = std::max(seconds, t);
+		if (simulation && result) result->merge_measurements(*simulation);
+		else if (simulation) result = simulation;
+		return finished==chains;
+	}
+
+	ChainGroup (int n) : chains(n), finished(0), seconds(0.0) {}
+};
+
+// one chain of a job of the configuration, read up front so that the workers
+// never touch the shared Lua state
+struct Job {
+	int index;
+	int chain;
+	int thermalization;
+	int sweeps;
+	std::string savefile;
+	SimulationParameters parameters;
+	std::shared_ptr<ChainGroup> group;
+	std::vector<double> ladder; // REPLICAS, values of the parameter named by exchange
+	std::string exchange;
+	int exchange_interval;
+	uint64_t seed;
+};
+
+// independent seed for chain c > 0 of a task seeded with seed
+lua_Integer chain_seed (uint64_t seed, int c) {
+	std::seed_seq seq { uint32_t(seed), uint32_t(seed>>32), uint32_t(c) };
+	std::mt19937_64 g(seq);
+	return lua_Integer(g()>>11); // exact even where Lua numbers are doubles
+}
+
+// a task with CHAINS = n runs n chains on their own threads: the sweeps are
+// shared out between them, and chain c thermalizes for c/n of THERMALIZATION
+// longer so that the chains do not finish and write at the same time.
+// A task with REPLICAS = { ... } is a single job running replica exchange in
+// EXCHANGE ("beta" or "mu"), with an attempt every EXCHANGE_INTERVAL updates
+// (default N); CHAINS does not apply to it
+std::vector<Job> read_jobs (lua_State *L) {
+	std::vector<Job> ret;
+	for (int i=1;;i++) {
+		lua_rawgeti(L, -1, i);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_getfield(L, -1, "THERMALIZATION"); int thermalization = lua_tointeger(L, -1); lua_pop(L, 1);
+		lua_getfield(L, -1, "SWEEPS"); int sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
+		lua_getfield(L, -1, "savefile"); std::string savefile = lua_isstring(L, -1)?lua_tostring(L, -1):std::string(); lua_pop(L, 1);
+		lua_getfield(L, -1, "CHAINS"); int chains = std::max<int>(lua_tointeger(L, -1), 1); lua_pop(L, 1);
+		uint64_t seed = 0;
+		lua_getfield(L, -1, "SEED");
+		if (lua_isnumber(L, -1)) seed = lua_tointeger(L, -1);
+		else if (lua_isstring(L, -1)) seed = std::hash<std::string>()(lua_tostring(L, -1));
+		lua_pop(L, 1);
+		std::vector<double> ladder;
+		lua_getfield(L, -1, "REPLICAS");
+		if (lua_istable(L, -1)) {
+			for (int r=1;;r++) {
+				lua_rawgeti(L, -1, r);
+				if (!lua_isnumber(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				ladder.push_back(lua_tonumber(L, -1));
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+		lua_getfield(L, -1, "EXCHANGE"); std::string exchange = lua_isstring(L, -1)?lua_tostring(L, -1):"beta"; lua_pop(L, 1);
+		if (exchange!="beta" && exchange!="mu") {
+			std::cerr << "EXCHANGE must be \"beta\" or \"mu\", not \"" << exchange << "\": using beta" << std::endl;
+			exchange = "beta";
+		}
+		lua_getfield(L, -1, "EXCHANGE_INTERVAL"); int exchange_interval = lua_tointeger(L, -1); lua_pop(L, 1);
+		if (exchange_interval<1) {
+			lua_getfield(L, -1, "N"); exchange_interval = std::max<int>(lua_tointeger(L, -1), 1); lua_pop(L, 1);
+		}
+		if (!ladder.empty()) chains = 1;
+		SimulationParameters parameters;
+		parameters.read(L, lua_gettop(L));
+		std::shared_ptr<ChainGroup> group = std::make_shared<ChainGroup>(chains);
+		for (int c=0;c<chains;c++) {
+			Job job;
+			job.index = i;
+			job.chain = c;
+			job.thermalization = thermalization + c*thermalization/chains;
+			job.sweeps = sweeps/chains + (c<sweeps%chains?1:0);
+			job.savefile = savefile;
+			if (chains>1 && !savefile.empty()) job.savefile += ".chain" + std::to_string(c);
+			job.parameters = parameters;
+			if (c>0) job.parameters.setSeed(chain_seed(seed, c));
+			job.group = group;
+			job.ladder = ladder;
+			job.exchange = exchange;
+			job.exchange_interval = exchange_interval;
+			job.seed = seed;
+			ret.push_back(job);
+		}
+		lua_pop(L, 1);
+	}
+	return ret;
+}
+
+// serializes the job table on top of the stack to its outfile and pops it
+void write_outfile (lua_State *L) {
+	lua_getglobal(L, "serialize");
+	lua_insert(L, -2);
+	lua_getfield(L, -1, "outfile");
+	lua_insert(L, -2);
+	lua_pcall(L, 2, 0, 0);
+}
+
+// stores the merged results of a task in its table and writes its outfile
+void write_results (lua_State *L, int job, const ChainGroup &group) {
+	group.result->output_results();
+	lua_rawgeti(L, -1, job);
+	lua_pushnumber(L, group.seconds);
+	lua_setfield(L, -2, "elapsed_time");
+	group.result->save(L, lua_gettop(L));
+	write_outfile(L);
+}
+
+// the same for a replica exchange task: one table per replica in "replicas"
+// and the swap acceptance of each neighbouring pair in "exchange_acceptance"
+void write_replica_results (lua_State *L, int job, const ReplicaExchange &exchange, double seconds) {
+	lua_rawgeti(L, -1, job);
+	lua_pushnumber(L, seconds);
+	lua_setfield(L, -2, "elapsed_time");
+	lua_newtable(L);
+	for (size_t r=0;r<exchange.simulations().size();r++) {
+		exchange.simulations()[r]->output_results();
+		lua_newtable(L);
+		exchange.simulations()[r]->save(L, lua_gettop(L));
+		lua_rawseti(L, -2, r+1);
+	}
+	lua_setfield(L, -2, "replicas");
+	lua_newtable(L);
+	for (size_t r=0;r<exchange.pairs();r++) {
+		L << exchange.acceptance(r);
+		lua_rawseti(L, -2, r+1);
+	}
+	lua_setfield(L, -2, "exchange_acceptance");
+	write_outfile(L);
+}
+
+void run_replicas (int j, Job &job, WriterThread &writer, Logger &log, std::atomic<int> &failed) {
+	steady_clock::time_point t_start = steady_clock::now();
+	std::vector<std::shared_ptr<Simulation>> replicas;
+	for (size_t r=0;r<job.ladder.size();r++) {
+		SimulationParameters p = job.parameters;
+		if (job.exchange=="mu") p.config.mu = job.ladder[r];
+		else p.config.beta = job.ladder[r];
+		if (r>0) p.setSeed(chain_seed(job.seed, r));
+		replicas.push_back(std::make_shared<Simulation>(p));
+	}
+	if (!job.savefile.empty()) log << "thread" << j << "ignoring savefile" << job.savefile << "of replica exchange task" << job.index;
+	std::shared_ptr<ReplicaExchange> exchange = std::make_shared<ReplicaExchange>();
+	exchange->setup(replicas, job.exchange_interval, chain_seed(job.seed, replicas.size()));
+	log << "thread" << j << "running simulation" << job.index << "with" << replicas.size() << "replicas in" << job.exchange;
+	try {
+		exchange->run(job.thermalization, job.sweeps);
+		double seconds = duration_cast<seconds_type>(steady_clock::now()-t_start).count();
+		log << "thread" << j << "finished simulation" << job.index << "in" << seconds << "seconds";
+		for (size_t r=0;r<exchange->pairs();r++) {
+			log << "replicas" << r << r+1 << "exchange acceptance" << exchange->acceptance(r).mean() << "+-" << exchange->acceptance(r).error();
+		}
+		const int index = job.index;
+		writer.push([exchange, index, seconds] (lua_State *L) {
+			write_replica_results(L, index, *exchange, seconds);
+		});
+	} catch (...) {
+		failed++;
+		log << "thread" << j << "caught exception in replica exchange simulation" << job.index;
+	}
+}
+
+void run_thread (int j, std::vector<Job> &jobs, WriterThread &writer, Logger &log, std::atomic<int> &current, std::atomic<int> &failed) {
 	signal(SIGINT, signal_handler);
 	steady_clock::time_point t0 = steady_clock::now();
 	steady_clock::time_point t1 = steady_clock::now();
@@ -66,64 +257,75 @@ void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic
 	log << "thread" << j << "starting";
 	while (true) {
 		steady_clock::time_point t_start = steady_clock::now();
-		int job = current.fetch_add(1);
-		lock.lock();
-		lua_rawgeti(L, -1, job);
-		if (lua_isnil(L, -1)) {
+		const size_t n = current.fetch_add(1);
+		if (n>=jobs.size()) {
 			log << "thread" << j << "terminating";
-			lua_pop(L, 1);
-			lock.unlock();
 			break;
 		}
-		log << "thread" << j << "running simulation" << job;
-		lua_getfield(L, -1, "THERMALIZATION"); int thermalization_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
-		lua_getfield(L, -1, "SWEEPS"); int total_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
-		lua_getfield(L, -1, "savefile"); std::string savefile = lua_isstring(L, -1)?lua_tostring(L, -1):std::string(); lua_pop(L, 1);
-		Simulation simulation(L, -1);
-		lua_pop(L, 1);
+		if (!jobs[n].ladder.empty()) {
+			run_replicas(j, jobs[n], writer, log, failed);
+			continue;
+		}
+		const int job = jobs[n].index;
+		std::shared_ptr<ChainGroup> group = jobs[n].group;
+		log << "thread" << j << "running simulation" << job << "chain" << jobs[n].chain;
+		int thermalization_sweeps = jobs[n].thermalization;
+		int total_sweeps = jobs[n].sweeps;
+		const std::string savefile = jobs[n].savefile;
+		std::shared_ptr<Simulation> simulation = std::make_shared<Simulation>(jobs[n].parameters);
 		if (!savefile.empty()) {
-			if (luaL_dofile(L, savefile.c_str())) {
-				log << "error loading savefile:" << lua_tostring(L, -1);
-				lua_pop(L, 1);
+			const CheckpointStatus status = simulation->load_checkpoint(savefile, thermalization_sweeps, total_sweeps);
+			if (status==CheckpointLoaded) {
+				log << "loaded binary checkpoint" << savefile;
+			} else if (status==CheckpointDamaged) {
+				log << "could not load binary checkpoint" << savefile << "- starting from scratch";
 			} else {
-				lua_getfield(L, -1, "THERMALIZATION"); thermalization_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
-				lua_getfield(L, -1, "SWEEPS"); total_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
-				simulation.load_checkpoint(L);
-				lua_pop(L, 1);
+				// old text checkpoints are Lua, run in a state of their own
+				lua_State *L = luaL_newstate();
+				luaL_openlibs(L);
+				if (luaL_dofile(L, savefile.c_str())) {
+					log << "error loading savefile:" << lua_tostring(L, -1);
+				} else {
+					lua_getfield(L, -1, "THERMALIZATION"); thermalization_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
+					lua_getfield(L, -1, "SWEEPS"); total_sweeps = lua_tointeger(L, -1); lua_pop(L, 1);
+					simulation->load_checkpoint(L);
+				}
+				lua_close(L);
 			}
-			if (thermalization_sweeps>0) simulation.discard_measurements();
+			if (thermalization_sweeps>0) simulation->discard_measurements();
 		}
-		//simulation.load_sigma(L, "nice.lua");
-		lock.unlock();
+		//simulation->load_sigma(L, "nice.lua");
+		// the checkpoint is assembled here and written by the writer thread
 		auto save_checkpoint = [&] (int thermalization, int sweeps) {
-			lock.lock();
-			simulation.save_checkpoint(L);
-			lua_pushinteger(L, thermalization);
-			lua_setfield(L, -2, "THERMALIZATION");
-			lua_pushinteger(L, sweeps);
-			lua_setfield(L, -2, "SWEEPS");
-			lua_pushstring(L, getenv("LSB_JOBID"));
-			lua_setfield(L, -2, "JOBID");
-			lua_getglobal(L, "serialize");
-			lua_insert(L, -2);
-			lua_pushstring(L, savefile.c_str());
-			lua_insert(L, -2);
-			lua_pcall(L, 2, 0, 0);
-			lock.unlock();
+			if (savefile.empty()) return;
+			const char *jobid = getenv("LSB_JOBID");
+			std::shared_ptr<CheckpointWriter> out = std::make_shared<CheckpointWriter>();
+			{
+				PROFILE_SCOPE(simulation->profile, Checkpoint, 0.0);
+				simulation->save_checkpoint(*out, thermalization, sweeps, jobid?jobid:"");
+			}
+			std::shared_ptr<Simulation> s = simulation;
+			writer.push([out, savefile, s] (lua_State *) {
+				PROFILE_SCOPE(s->profile, Checkpoint, 0.0);
+				out->commit(savefile);
+			});
 		};
 		auto save_density = [&] (const char *n) {
-			int N = simulation.timeSlices();
-			int V = simulation.volume();
+			int N = simulation->timeSlices();
+			int V = simulation->volume();
 			ofstream dens(n);
 			for (int i=0;i<V;i++) {
 				dens << i << ' ' << i << ' ';
-				dens << measurement_ratio(simulation.d_up[i], simulation.measured_sign, " ") << ' ';
-				dens << measurement_ratio(simulation.d_dn[i], simulation.measured_sign, " ") << ' ';
-				dens << measurement_ratio(simulation.spincorrelation[i], simulation.measured_sign, " ") << ' ';
+				dens << measurement_ratio(simulation->d_up[i], simulation->measured_sign, " ") << ' ';
+				dens << measurement_ratio(simulation->d_dn[i], simulation->measured_sign, " ") << ' ';
+				dens << measurement_ratio(simulation->spincorrelation[i], simulation->measured_sign, " ") << ' ';
 				dens << endl;
 			}
 		};
 		save_checkpoint(thermalization_sweeps, total_sweeps);
+		size_t last_allocations = simulation->svd_allocations();
+		size_t last_stabilizations = simulation->stabilizations();
+		int last_sweep = 0;
 		try {
 			t0 = steady_clock::now();
 			t1 = steady_clock::now();
@@ -136,20 +338,28 @@ void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic
 				}
 				if (duration_cast<seconds_type>(steady_clock::now()-t1).count()>5) {
 					t1 = steady_clock::now();
-					int N = simulation.timeSlices();
-					int V = simulation.volume();
-					log << "thread" << j << "thermalizing: " << i << '/' << thermalization_sweeps << "..." << (double(simulation.steps)/duration_cast<seconds_type>(t1-t0).count()) << "steps per second (" << N*V << "sites sweep in" << (duration_cast<seconds_type>(t1-t0).count()*N*V/simulation.steps) << "seconds)";
-					log << simulation.measured_sign;
-					log << "Density: " << measurement_ratio(simulation.density, simulation.measured_sign, " +- ");
-					log << "Magnetization: " << measurement_ratio(simulation.magnetization, simulation.measured_sign, " +- ") << '\n';
+					int N = simulation->timeSlices();
+					int V = simulation->volume();
+					log << "thread" << j << "thermalizing: " << i << '/' << thermalization_sweeps << "..." << (double(simulation->steps)/duration_cast<seconds_type>(t1-t0).count()) << "steps per second (" << N*V << "sites sweep in" << (duration_cast<seconds_type>(t1-t0).count()*N*V/simulation->steps) << "seconds)";
+					log << simulation->measured_sign;
+					log << "Density: " << measurement_ratio(simulation->density, simulation->measured_sign, " +- ");
+					log << "Magnetization: " << measurement_ratio(simulation->magnetization, simulation->measured_sign, " +- ");
+					log << "SVD allocations per sweep:" << double(simulation->svd_allocations()-last_allocations)/std::max(i-last_sweep, 1) << '\n';
+					log << "stabilizations per sweep:" << double(simulation->stabilizations()-last_stabilizations)/std::max(i-last_sweep, 1) << '\n';
+					last_allocations = simulation->svd_allocations();
+					last_stabilizations = simulation->stabilizations();
+					last_sweep = i;
 					//save_density("density.dat");
 				}
-				simulation.update();
-				simulation.measure_quick();
+				simulation->update();
+				simulation->measure_quick();
 			}
 			log << "thread" << j << "thermalized";
-			simulation.steps = 0;
-			simulation.discard_measurements();
+			simulation->steps = 0;
+			simulation->discard_measurements();
+			last_allocations = simulation->svd_allocations();
+			last_stabilizations = simulation->stabilizations();
+			last_sweep = 0;
 			t0 = steady_clock::now();
 			for (int i=0;i<total_sweeps;i++) {
 				if (duration_cast<seconds_type>(steady_clock::now()-t2).count()>600 && !savefile.empty()) {
@@ -158,31 +368,31 @@ void run_thread (int j, lua_State *L, Logger &log, std::mutex &lock, std::atomic
 				}
 				if (duration_cast<seconds_type>(steady_clock::now()-t1).count()>5) {
 					t1 = steady_clock::now();
-					log << "thread" << j << "running: " << i << '/' << total_sweeps << "..." << (double(simulation.steps)/duration_cast<seconds_type>(t1-t0).count()) << "steps per second";
+					log << "thread" << j << "running: " << i << '/' << total_sweeps << "..." << (double(simulation->steps)/duration_cast<seconds_type>(t1-t0).count()) << "steps per second";
+					log << "SVD allocations per sweep:" << double(simulation->svd_allocations()-last_allocations)/std::max(i-last_sweep, 1);
+					log << "stabilizations per sweep:" << double(simulation->stabilizations()-last_stabilizations)/std::max(i-last_sweep, 1);
+					last_allocations = simulation->svd_allocations();
+					last_stabilizations = simulation->stabilizations();
+					last_sweep = i;
 					//save_density("density.dat");
 				}
-				simulation.update();
-				simulation.measure_quick();
-				//simulation.measure_sign();
+				simulation->update();
+				simulation->measure_quick();
+				//simulation->measure_sign();
 			}
 			double seconds = duration_cast<seconds_type>(steady_clock::now()-t_start).count();
 			log << "thread" << j << "finished simulation" << job << "in" << seconds << "seconds";
-			lock.lock();
-			simulation.output_results();
-			lua_rawgeti(L, -1, job);
-			lua_pushnumber(L, seconds);
-			lua_setfield(L, -2, "elapsed_time");
-			simulation.save(L, lua_gettop(L));
-			lua_getglobal(L, "serialize");
-			lua_insert(L, -2);
-			lua_getfield(L, -1, "outfile");
-			lua_insert(L, -2);
-			lua_pcall(L, 2, 0, 0);
+			// the writer thread owns the shared Lua state and does the output
+			writer.push([simulation, group, job, seconds] (lua_State *L) {
+				if (group->add(simulation, seconds)) write_results(L, job, *group);
+			});
 			//save_density("density.dat");
-			lock.unlock();
 		} catch (...) {
 			failed++;
-			log << "thread" << j << "caught exception in simulation" << job << " with params " << simulation.params();
+			log << "thread" << j << "caught exception in simulation" << job << " with params " << simulation->params();
+			writer.push([group, job] (lua_State *L) {
+				if (group->add(nullptr, 0.0) && group->result) write_results(L, job, *group);
+			});
 		}
 	}
 }
@@ -198,6 +408,7 @@ int main (int argc, char **argv) {
 
 	fftw_init_threads();
 	fftw_plan_with_nthreads(1);
+	fftw_make_planner_thread_safe();
 
 	int nthreads = 1;
 	char *e = getenv("LSB_HOSTS");
@@ -212,16 +423,18 @@ int main (int argc, char **argv) {
 	//log.setVerbosity(5);
 	log << "using" << nthreads << "threads";
 
+	std::vector<Job> jobs = read_jobs(L);
 	std::vector<std::thread> threads(nthreads);
-	std::mutex lock;
+	WriterThread writer(L);
 	std::atomic<int> failed;
 	failed = 0;
 	std::atomic<int> current;
-	current = 1;
+	current = 0;
 	for (int j=0;j<nthreads;j++) {
-		threads[j] = std::thread(run_thread, j, L, std::ref(log), std::ref(lock), std::ref(current), std::ref(failed));
+		threads[j] = std::thread(run_thread, j, std::ref(jobs), std::ref(writer), std::ref(log), std::ref(current), std::ref(failed));
 	}
 	for (std::thread& t : threads) t.join();
+	writer.stop();
 	log << "joined threads";
 	lua_getglobal(L, "serialize");
 	lua_insert(L, -2);
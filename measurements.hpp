@@ -3,15 +3,25 @@
 
 #include <vector>
 #include <iostream>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
 
 #include <cmath>
 
+#include <Eigen/Core>
+
 extern "C" {
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 }
 
+// Eigen arrays are binned in place, see measurement::add
+template <typename T> struct in_place_bins : std::false_type {};
+template <typename S, int R, int C, int O, int MR, int MC>
+struct in_place_bins<Eigen::Array<S, R, C, O, MR, MC>> : std::true_type {};
+
 template <typename T, bool Log = false>
 class measurement {
 	private:
@@ -20,6 +30,7 @@ class measurement {
 		std::vector<T> x_;
 		std::vector<int> n_;
 		std::string name_;
+		T carry_;
 	public:
 		const std::string &name () const { return name_; }
 		void set_name (const std::string &name) { name_ = name; }
@@ -38,36 +49,31 @@ class measurement {
 		void clear () { set_bins(0); }
 
 		template <typename U>
-		void add (U &&x) {
-			T nx = std::forward<U>(x);
-			for (size_t i=0;;i++) {
-				if (i==n_.size()) {
-					sums_.push_back(T());
-					squared_sums_.push_back(T());
-					x_.push_back(T());
-					n_.push_back(0);
-					if (Log) break;
-				}
-				if (n_[i]==0) {
-					sums_[i] = nx;
-					squared_sums_[i] = nx * nx;
-				} else {
-					sums_[i] += nx;
-					squared_sums_[i] += nx * nx;
-				}
-				n_[i] += 1;
-				if (n_[i]%2==1) {
-					x_[i] = nx;
-					break;
-				} else {
-					nx = (nx + x_[i]) / 2.0;
-					x_[i] = nx;
-				}
-			}
-		}
+		void add (U &&x) { add(std::forward<U>(x), in_place_bins<T>()); }
 
 		void repeat () { add(x_[0]); }
 
+		// adds the samples of an independent run of the same observable:
+		// sums, squares and counts of each bin level add up, so the merged
+		// errors are those of the pooled samples. Levels only one of the two
+		// has reached are dropped, the pending last values are ours.
+		void merge (const measurement &m) {
+			if (m.bins()==0) return;
+			if (bins()==0) {
+				sums_ = m.sums_;
+				squared_sums_ = m.squared_sums_;
+				x_ = m.x_;
+				n_ = m.n_;
+				return;
+			}
+			set_bins(std::min(bins(), m.bins()));
+			for (size_t i=0;i<bins();i++) {
+				sums_[i] += m.sums_[i];
+				squared_sums_[i] += m.squared_sums_[i];
+				n_[i] += m.n_[i];
+			}
+		}
+
 		T last_value (int i = 0) const { return x_[i]; }
 		T sum (int i = 0) const { return sums_[i]; }
 		T mean (int i = 0) const { if (bins()>0) return sums_[i] / double(n_[i]); else return T(); }
@@ -107,6 +113,89 @@ class measurement {
 		measurement () : name_("Result") {}
 
 	protected:
+		template <typename U>
+		void add (U &&x, std::false_type) {
+			T nx = std::forward<U>(x);
+			for (size_t i=0;;i++) {
+				if (i==n_.size()) {
+					open_bin();
+					if (Log) break;
+				}
+				if (n_[i]==0) {
+					sums_[i] = nx;
+					squared_sums_[i] = nx * nx;
+				} else {
+					sums_[i] += nx;
+					squared_sums_[i] += nx * nx;
+				}
+				n_[i] += 1;
+				if (n_[i]%2==1) {
+					x_[i] = nx;
+					break;
+				} else {
+					nx = (nx + x_[i]) / 2.0;
+					x_[i] = nx;
+				}
+			}
+		}
+
+		// same binning for arrays, but the carried value lives in carry_ and
+		// each level is one fused pass over sum, square, last value and carry:
+		// once a level holds its arrays no sample allocates, only opening a
+		// new level does
+		template <typename U>
+		void add (U &&x, std::true_type) {
+			typedef typename T::Scalar Scalar;
+			assign(carry_, std::forward<U>(x));
+			const typename T::Index size = carry_.size();
+			for (size_t i=0;;i++) {
+				if (i==n_.size()) {
+					open_bin();
+					if (Log) break;
+				}
+				if (n_[i]==0) {
+					sums_[i].setZero(carry_.rows(), carry_.cols());
+					squared_sums_[i].setZero(carry_.rows(), carry_.cols());
+					x_[i].resizeLike(carry_);
+				}
+				n_[i] += 1;
+				const bool odd = n_[i]%2==1;
+				Scalar *c = carry_.data();
+				Scalar *s = sums_[i].data();
+				Scalar *q = squared_sums_[i].data();
+				Scalar *l = x_[i].data();
+				if (odd) {
+					for (typename T::Index k=0;k<size;k++) {
+						s[k] += c[k];
+						q[k] += c[k]*c[k];
+						l[k] = c[k];
+					}
+				} else {
+					for (typename T::Index k=0;k<size;k++) {
+						s[k] += c[k];
+						q[k] += c[k]*c[k];
+						l[k] = c[k] = (c[k]+l[k])/2.0;
+					}
+				}
+				if (odd) break;
+			}
+		}
+
+		void open_bin () {
+			sums_.push_back(T());
+			squared_sums_.push_back(T());
+			x_.push_back(T());
+			n_.push_back(0);
+		}
+
+		template <typename D>
+		static void assign (T &dst, const Eigen::ArrayBase<D> &x) { dst = x; }
+
+		template <typename D>
+		static void assign (T &dst, const Eigen::MatrixBase<D> &x) {
+			dst.resize(x.rows(), x.cols());
+			dst.matrix() = x;
+		}
 };
 
 template <typename T, bool Log> std::ostream& operator<< (std::ostream& out, const measurement<T, Log>& m) {
@@ -0,0 +1,106 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+// time, calls and estimated floating point work of the hot phases of one
+// simulation. The counters are atomic since the spin chains may run on two
+// threads. Scopes nest, so times are inclusive: metropolis contains rank1.
+class PhaseProfile {
+	public:
+
+	enum Phase { Metropolis, Rank1, Flush, Stabilization, Propagation, Measure, GreenFunction, Checkpoint, SpinWait, Phases };
+
+	static const char* name (int p) {
+		static const char *names[] = {
+			"metropolis", "rank1_probability", "flush_updates", "stabilization",
+			"propagation", "measure", "green_function", "checkpoint", "spin_wait",
+		};
+		return names[p];
+	}
+
+	void add (Phase p, uint64_t ns, double flops) {
+		nanoseconds[p] += ns;
+		calls[p] += 1;
+		flop[p] += uint64_t(flops);
+	}
+
+	void merge (const PhaseProfile &other) {
+		for (int p=0;p<Phases;p++) {
+			nanoseconds[p] += other.nanoseconds[p];
+			calls[p] += other.calls[p];
+			flop[p] += other.flop[p];
+		}
+	}
+
+	void clear () {
+		for (int p=0;p<Phases;p++) nanoseconds[p] = calls[p] = flop[p] = 0;
+	}
+
+	// profile = { phase = { seconds, calls, gflop, gflops }, ... } in the
+	// table at index, leaving out phases that never ran
+	void save (lua_State *L, int index) const {
+		lua_newtable(L);
+		for (int p=0;p<Phases;p++) {
+			if (calls[p]==0) continue;
+			const double seconds = 1.0e-9*nanoseconds[p];
+			lua_newtable(L);
+			lua_pushnumber(L, seconds);
+			lua_setfield(L, -2, "seconds");
+			lua_pushnumber(L, calls[p]);
+			lua_setfield(L, -2, "calls");
+			if (flop[p]>0) {
+				lua_pushnumber(L, 1.0e-9*flop[p]);
+				lua_setfield(L, -2, "gflop");
+				lua_pushnumber(L, seconds>0.0?1.0e-9*flop[p]/seconds:0.0);
+				lua_setfield(L, -2, "gflops");
+			}
+			lua_setfield(L, -2, name(p));
+		}
+		lua_setfield(L, index, "profile");
+	}
+
+	PhaseProfile () { clear(); }
+	PhaseProfile (const PhaseProfile &) = delete;
+	PhaseProfile& operator= (const PhaseProfile &) = delete;
+
+	private:
+	std::atomic<uint64_t> nanoseconds[Phases];
+	std::atomic<uint64_t> calls[Phases];
+	std::atomic<uint64_t> flop[Phases];
+};
+
+class PhaseTimer {
+	PhaseProfile &profile;
+	PhaseProfile::Phase phase;
+	double flops;
+	std::chrono::steady_clock::time_point t0;
+
+	public:
+
+	PhaseTimer (PhaseProfile &p, PhaseProfile::Phase ph, double f) : profile(p), phase(ph), flops(f), t0(std::chrono::steady_clock::now()) {}
+	~PhaseTimer () {
+		profile.add(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count(), flops);
+	}
+};
+
+// PROFILE_SCOPE(profile, Phase, flops) times the rest of the enclosing block.
+// Without -DPROFILE_PHASES (see make profile) it expands to nothing and its
+// arguments are not evaluated.
+#ifdef PROFILE_PHASES
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(profile, phase, flops) PhaseTimer PROFILE_CONCAT(phase_timer_, __LINE__)((profile), PhaseProfile::phase, (flops))
+#else
+#define PROFILE_SCOPE(profile, phase, flops)
+#endif
+
+#endif // PROFILER_HPP
@@ -0,0 +1,125 @@
+#ifndef REPLICA_EXCHANGE_HPP
+#define REPLICA_EXCHANGE_HPP
+
+#include "simulation.hpp"
+#include "measurements.hpp"
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+// parallel tempering: replicas at a ladder of beta or mu are updated side by
+// side, one thread each, and every interval updates neighbouring replicas try
+// to swap their HS fields with probability
+//   min(1, W_a(s_b) W_b(s_a) / W_a(s_a) W_b(s_b))
+// where the current weights are the replicas' plog and the crossed ones are
+// recomputed from scratch. Even and odd pairs are tried in turn. The
+// replicas stay at their parameters, only the fields travel.
+class ReplicaExchange {
+	std::vector<std::shared_ptr<Simulation>> replicas;
+	std::vector<mymeasurement<double>> acceptance_; // pair (r, r+1)
+	std::mt19937_64 generator;
+	std::uniform_real_distribution<double> distribution;
+	int interval;
+	int parity;
+
+	// f(r) for every replica, each on its own thread
+	void parallel (const std::function<void(int)> &f) {
+		const int R = replicas.size();
+		std::vector<std::exception_ptr> errors(R);
+		std::vector<std::thread> threads;
+		auto run = [&] (int r) {
+			try {
+				f(r);
+			} catch (...) {
+				errors[r] = std::current_exception();
+			}
+		};
+		for (int r=1;r<R;r++) threads.push_back(std::thread(run, r));
+		run(0);
+		for (std::thread &t : threads) t.join();
+		for (std::exception_ptr &e : errors) if (e) std::rethrow_exception(e);
+	}
+
+	void advance (int n) {
+		parallel([this, n] (int r) {
+			for (int i=0;i<n;i++) {
+				replicas[r]->update();
+				replicas[r]->measure_quick();
+			}
+		});
+	}
+
+	void exchange () {
+		const int R = replicas.size();
+		std::vector<std::vector<Vector_d>> fields(R);
+		std::vector<double> weight(R);
+		std::vector<int> partner(R, -1);
+		for (int r=0;r<R;r++) {
+			fields[r] = replicas[r]->fields();
+			weight[r] = replicas[r]->plog;
+		}
+		for (int r=parity;r+1<R;r+=2) {
+			partner[r] = r+1;
+			partner[r+1] = r;
+		}
+		parity ^= 1;
+		parallel([&] (int r) {
+			if (partner[r]>=0) replicas[r]->set_fields(fields[partner[r]]);
+		});
+		std::vector<char> rejected(R, 0);
+		for (int r=0;r+1<R;r++) {
+			if (partner[r]!=r+1) continue;
+			const double d = replicas[r]->plog+replicas[r+1]->plog-weight[r]-weight[r+1];
+			const bool accepted = d>=0.0 || distribution(generator)<std::exp(d);
+			acceptance_[r].add(accepted?1.0:0.0);
+			if (!accepted) rejected[r] = rejected[r+1] = 1;
+		}
+		parallel([&] (int r) {
+			if (rejected[r]) replicas[r]->set_fields(fields[r]);
+		});
+	}
+
+	void run (int updates) {
+		for (int done=0;done<updates;) {
+			const int n = std::min(interval, updates-done);
+			advance(n);
+			done += n;
+			if (done%interval==0) exchange();
+		}
+	}
+
+	public:
+
+	// replicas must share N and V; seed is for the swap decisions only
+	void setup (const std::vector<std::shared_ptr<Simulation>> &r, int n, uint64_t seed) {
+		replicas = r;
+		interval = std::max(n, 1);
+		parity = 0;
+		generator.seed(seed);
+		acceptance_.assign(replicas.size()>0?replicas.size()-1:0, mymeasurement<double>());
+	}
+
+	void run (int thermalization, int sweeps) {
+		run(thermalization);
+		parallel([this] (int r) {
+			replicas[r]->steps = 0;
+			replicas[r]->discard_measurements();
+		});
+		for (mymeasurement<double> &a : acceptance_) a.clear();
+		run(sweeps);
+	}
+
+	const std::vector<std::shared_ptr<Simulation>>& simulations () const { return replicas; }
+	size_t pairs () const { return acceptance_.size(); }
+	const mymeasurement<double>& acceptance (int r) const { return acceptance_[r]; }
+
+	ReplicaExchange () : distribution(0.0, 1.0), interval(1), parity(0) {}
+};
+
+#endif // REPLICA_EXCHANGE_HPP
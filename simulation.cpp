@@ -2,6 +2,9 @@
 #include "mpfr.hpp"
 
 #include "lua_tuple.hpp"
+#include "svd_tuner.hpp"
+#include "checkpoint.hpp"
+#include "profiler.hpp"
 
 // FIXME only works in 2D
 void Simulation::prepare_open_boundaries () {
@@ -18,6 +21,7 @@ void Simulation::prepare_fft () {
 			size, 1, V, positionSpace.data(), size, 1, V, FFTW_PATIENT);
 	positionSpace.setIdentity(V, V);
 	momentumSpace.setZero(V, V);
+	momentumSpace_dn.setZero(V, V);
 }
 
 
@@ -76,12 +80,24 @@ void Simulation::prepare_propagators () {
 	hamiltonian = H;
 	eigenvectors = solver.eigenvectors();
 	energies = solver.eigenvalues();
+	freePropagator_matrix_f = freePropagator_matrix.cast<float>();
+	free_logdet = -dt*energies.sum();
+	// the rounded propagator has a determinant of its own
+	free_logdet_f = freePropagator_matrix_f.cast<double>().partialPivLu().matrixLU().diagonal().array().abs().log().sum();
 
 	fftw_execute(x2p_col);
 	momentumSpace.applyOnTheLeft(freePropagator_diagonal.asDiagonal());
 	fftw_execute(p2x_col);
 	std::cerr << "propagator difference = " << (freePropagator_matrix-positionSpace/V).norm() << std::endl;
 	use_fft = (freePropagator_matrix-positionSpace/V).norm()<1e-10;
+	translation_invariant = use_fft;
+	if (use_checkerboard) {
+		checkerboard.build(H, dt);
+		std::cerr << "checkerboard: " << checkerboard.families() << " bond families, difference = "
+			<< (checkerboard.matrix()-freePropagator_matrix).norm()/freePropagator_matrix.norm()
+			<< ", inverse error = " << (checkerboard.matrix(true)*checkerboard.matrix()-Matrix_d::Identity(V, V)).norm() << std::endl;
+		use_fft = false;
+	}
 	std::cerr << (use_fft?"":"not ") << "using FFT" << std::endl;
 }
 
@@ -91,6 +107,10 @@ void Simulation::init () {
 	if (Lz<2) { Lz = 1; tz = 0.0; }
 	V = Lx * Ly * Lz;
 	time_shift = 0;
+	mixed_precision_fallbacks = 0;
+	flushes = 0;
+	gf_calls = 0;
+	update_flushed.assign(V, 0);
 	if (flips_per_update<1) flips_per_update = V;
 	randomPosition = std::uniform_int_distribution<int>(0, V-1);
 	randomTime = std::uniform_int_distribution<int>(0, N-1);
@@ -108,42 +128,55 @@ void Simulation::init () {
 	positionSpace.setIdentity(V, V);
 	momentumSpace.setIdentity(V, V);
 
+	svd.setMethod(decomposition);
+	svdA.setMethod(decomposition);
+	svdB.setMethod(decomposition);
+
+	SVDHelper::Driver driver = SVDHelper::driverFromName(svd_driver);
+	if (svd_driver=="auto") {
+		SVDTuner tuner;
+		tuner.setSlices(N, msvd);
+		driver = tuner.tune(V);
+	}
+	svd.setDriver(driver);
+	svdA.setDriver(driver);
+	svdB.setDriver(driver);
+
+	spin_tasks.setEnabled(parallel_spins);
+	spin_tasks.setProfile(&profile);
+
+	svd_schedule.setInterval(msvd*dt);
+	svd_schedule.setLimits(dt, beta);
+	svd_schedule.setAdaptive(adaptive_svd);
+
 	prepare_fft();
 	prepare_propagators();
 	prepare_open_boundaries();
+	prepare_symmetries();
+	correlations.setup(Lx, Ly, Lz);
+	if (gf_reduced && !translation_invariant) {
+		std::cerr << "gf_reduced: the lattice is not translation invariant, storing the full Green function" << std::endl;
+		gf_reduced = false;
+	}
 
 	valid_slices.clear();
 	valid_slices.insert(valid_slices.begin(), nslices(), false);
 	std::tie(plog, psign) = make_plain_inverse();
-	std::tie(plog, psign) = make_svd_inverse();
+	make_svd_stack();
+	std::tie(plog, psign) = make_svd_inverse(false);
 
 	init_measurements();
 	reset_updates();
 }
 
-void Simulation::load (lua_State *L, int index) {
+void SimulationParameters::read (lua_State *L, int index) {
 	lua_pushvalue(L, index);
 	lua_get(L, config);
 	lua_pop(L, 1);
-	//std::cerr << config << std::endl;
-	Lx = config.Lx;
-	Ly = config.Ly;
-	Lz = config.Lz;
-	N = config.N;
-	beta = config.beta;
-	tx = config.tx;
-	ty = config.ty;
-	tz = config.tz;
-	g = fabs(config.U);
-	mu = config.mu;
-	B = config.B;
 	lua_getfield(L, index, "SEED");
-	if (lua_isnumber(L, -1)) {
-		generator.seed(lua_tointeger(L, -1));
-	} else if (lua_isstring(L, -1)) {
-		std::stringstream in(std::string(lua_tostring(L, -1)));
-		in >> generator;
-	}
+	seeded = lua_isnumber(L, -1);
+	seed = seeded?lua_tointeger(L, -1):0;
+	seed_state = !seeded && lua_isstring(L, -1)?lua_tostring(L, -1):"";
 	lua_pop(L, 1);
 	lua_getfield(L, index, "w_x");     w_x = lua_tonumber(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "w_y");     w_y = lua_tonumber(L, -1);            lua_pop(L, 1);
@@ -153,11 +186,81 @@ void Simulation::load (lua_State *L, int index) {
 	//lua_getfield(L, index, "REWEIGHT");  reweight = lua_tointeger(L, -1);      lua_pop(L, 1);
 	lua_getfield(L, index, "OUTPUT");  outfn = lua_tostring(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "gf_file"); gf_name = lua_tostring(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "corr_file"); corr_name = lua_isstring(L, -1)?lua_tostring(L, -1):""; lua_pop(L, 1);
+	lua_getfield(L, index, "gf_reduced"); gf_reduced = lua_toboolean(L, -1); lua_pop(L, 1);
+	lua_getfield(L, index, "gf_interval"); gf_interval = lua_isnumber(L, -1)?lua_tointeger(L, -1):1; lua_pop(L, 1);
 	lua_getfield(L, index, "SLICES");  mslices = lua_tointeger(L, -1);         lua_pop(L, 1);
 	lua_getfield(L, index, "SVD");     msvd = lua_tointeger(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "flips_per_update");     flips_per_update = lua_tointeger(L, -1);            lua_pop(L, 1);
 	lua_getfield(L, index, "use_fft");     use_fft = lua_toboolean(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "checkerboard");     use_checkerboard = lua_toboolean(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "decomposition");
+	if (lua_isstring(L, -1)) {
+		decomposition = std::string(lua_tostring(L, -1))=="udt"?SVDHelper::UDT:SVDHelper::SVD;
+	} else {
+		decomposition = SVD_DEFAULT_METHOD;
+	}
+	lua_pop(L, 1);
+	lua_getfield(L, index, "svd_driver");
+	svd_driver = lua_isstring(L, -1)?lua_tostring(L, -1):"gesvd";
+	lua_pop(L, 1);
+	lua_getfield(L, index, "mixed_precision");     mixed_precision = lua_toboolean(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "mixed_precision_threshold");
+	mixed_precision_threshold = lua_isnumber(L, -1)?lua_tonumber(L, -1):1.0e-3;
+	lua_pop(L, 1);
+	lua_getfield(L, index, "adaptive_svd");     adaptive_svd = lua_toboolean(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "max_update_size");     max_update_size = lua_tointeger(L, -1);            lua_pop(L, 1);
+	lua_getfield(L, index, "parallel_spins");     parallel_spins = lua_toboolean(L, -1);            lua_pop(L, 1);
 	//lua_getfield(L, index, "LOGFILE");  logfile.open(lua_tostring(L, -1));     lua_pop(L, 1);
+}
+
+void Simulation::load (lua_State *L, int index) {
+	SimulationParameters p;
+	p.read(L, index);
+	load(p);
+}
+
+void Simulation::load (const SimulationParameters &p) {
+	config = p.config;
+	//std::cerr << config << std::endl;
+	Lx = config.Lx;
+	Ly = config.Ly;
+	Lz = config.Lz;
+	N = config.N;
+	beta = config.beta;
+	tx = config.tx;
+	ty = config.ty;
+	tz = config.tz;
+	g = fabs(config.U);
+	mu = config.mu;
+	B = config.B;
+	if (!p.seed_state.empty()) {
+		std::stringstream in(p.seed_state);
+		in >> generator;
+	} else if (p.seeded) {
+		generator.seed(p.seed);
+	}
+	w_x = p.w_x;
+	w_y = p.w_y;
+	w_z = p.w_z;
+	reset = p.reset;
+	outfn = p.outfn;
+	gf_name = p.gf_name;
+	corr_name = p.corr_name;
+	gf_reduced = p.gf_reduced;
+	gf_interval = p.gf_interval;
+	mslices = p.mslices;
+	msvd = p.msvd;
+	flips_per_update = p.flips_per_update;
+	use_fft = p.use_fft;
+	use_checkerboard = p.use_checkerboard;
+	decomposition = p.decomposition;
+	svd_driver = p.svd_driver;
+	mixed_precision = p.mixed_precision;
+	mixed_precision_threshold = p.mixed_precision_threshold;
+	adaptive_svd = p.adaptive_svd;
+	max_update_size = p.max_update_size;
+	parallel_spins = p.parallel_spins;
 	init();
 }
 
@@ -186,6 +289,17 @@ void Simulation::save (lua_State *L, int index) {
 	lua_pushinteger(L, msvd); lua_setfield(L, index, "SVD");
 	lua_pushinteger(L, flips_per_update); lua_setfield(L, index, "flips_per_update");
 	lua_pushboolean(L, use_fft?1:0); lua_setfield(L, index, "use_fft");
+	lua_pushboolean(L, use_checkerboard?1:0); lua_setfield(L, index, "checkerboard");
+	lua_pushinteger(L, gf_interval); lua_setfield(L, index, "gf_interval");
+	lua_pushboolean(L, gf_reduced?1:0); lua_setfield(L, index, "gf_reduced");
+	lua_pushstring(L, corr_name.c_str()); lua_setfield(L, index, "corr_file");
+	lua_pushstring(L, decomposition==SVDHelper::UDT?"udt":"svd"); lua_setfield(L, index, "decomposition");
+	lua_pushstring(L, svd_driver.c_str()); lua_setfield(L, index, "svd_driver");
+	lua_pushboolean(L, mixed_precision?1:0); lua_setfield(L, index, "mixed_precision");
+	lua_pushnumber(L, mixed_precision_threshold); lua_setfield(L, index, "mixed_precision_threshold");
+	lua_pushboolean(L, adaptive_svd?1:0); lua_setfield(L, index, "adaptive_svd");
+	lua_pushinteger(L, max_update_size); lua_setfield(L, index, "max_update_size");
+	lua_pushboolean(L, parallel_spins?1:0); lua_setfield(L, index, "parallel_spins");
 	lua_newtable(L);
 	L << sign;
 	lua_setfield(L, -2, "sign");
@@ -212,6 +326,9 @@ void Simulation::save (lua_State *L, int index) {
 	L << chi_d;
 	lua_setfield(L, -2, "chi_d");
 	lua_setfield(L, index, "results");
+#ifdef PROFILE_PHASES
+	profile.save(L, index);
+#endif
 }
 
 void Simulation::load_checkpoint (lua_State *L) {
@@ -274,6 +391,7 @@ void Simulation::load_checkpoint (lua_State *L) {
 	}
 	//std::cerr << std::endl;
 	lua_pop(L, 1);
+	refresh_fields();
 }
 
 void Simulation::save_checkpoint (lua_State *L) {
@@ -322,33 +440,208 @@ void Simulation::save_checkpoint (lua_State *L) {
 	lua_setfield(L, -2, "sigma");
 }
 
+std::vector<std::pair<const char*, mymeasurement<double>*>> Simulation::checkpoint_measurements () {
+	return {
+		{ "sign", &sign },
+		{ "acceptance", &acceptance },
+		{ "density", &density },
+		{ "magnetization", &magnetization },
+		{ "order_parameter", &order_parameter },
+		{ "chi_af", &chi_af },
+		{ "exact_sign", &exact_sign },
+		{ "chi_d", &chi_d },
+	};
+}
+
+// binary counterpart of the Lua checkpoint: CheckpointNotBinary lets the
+// caller fall back to the Lua loader. A damaged file is reported and leaves
+// the simulation untouched.
+CheckpointStatus Simulation::load_checkpoint (const std::string &fn, int &thermalization, int &sweeps) {
+	CheckpointReader in;
+	if (!in.open(fn)) return CheckpointNotBinary;
+	const std::string kind = in.read_string();
+	const int64_t therm = in.read<int64_t>();
+	const int64_t sw = in.read<int64_t>();
+	in.read_string(); // job id
+	const std::string seed = in.read_string();
+	const int64_t shift = in.read<int64_t>();
+	const int64_t oldN = in.read<int64_t>();
+	const int64_t oldV = in.read<int64_t>();
+	int64_t n;
+	const char *sigma = in.read_array(n);
+	std::vector<std::pair<std::string, mymeasurement<double>>> results;
+	const int64_t count = in.read<int64_t>();
+	for (int64_t i=0;i<count && in.good();i++) {
+		results.push_back(std::make_pair(std::string(), mymeasurement<double>()));
+		results.back().first = in.read(results.back().second);
+	}
+	if (!in.good() || kind!="Simulation" || oldN<1 || oldV<1 || n!=oldN*oldV) {
+		std::cerr << "damaged checkpoint " << fn << std::endl;
+		return CheckpointDamaged;
+	}
+	std::stringstream seed_in(seed);
+	seed_in >> generator;
+	time_shift = shift;
+	for (const auto &r : results) {
+		for (const auto &m : checkpoint_measurements()) {
+			if (r.first==m.first) *m.second = r.second;
+		}
+	}
+	for (int i=0;i<N;i++) {
+		int t = oldN<N?i%oldN:i;
+		for (int j=0;j<V;j++) {
+			int x = j%oldV;
+			diagonals[t][x] = CheckpointReader::value(sigma, t*oldV+x)<0.0?-A:A;
+		}
+	}
+	refresh_fields();
+	thermalization = therm;
+	sweeps = sw;
+	return CheckpointLoaded;
+}
+
+bool Simulation::save_checkpoint (const std::string &fn, int thermalization, int sweeps, const std::string &jobid) {
+	CheckpointWriter out;
+	save_checkpoint(out, thermalization, sweeps, jobid);
+	return out.commit(fn);
+}
+
+// fills out without writing it, so that the file I/O can happen elsewhere
+void Simulation::save_checkpoint (CheckpointWriter &out, int thermalization, int sweeps, const std::string &jobid) {
+	std::stringstream seed;
+	seed << generator;
+	out.write(std::string("Simulation"));
+	out.write(int64_t(thermalization));
+	out.write(int64_t(sweeps));
+	out.write(jobid);
+	out.write(seed.str());
+	out.write(int64_t(time_shift));
+	out.write(int64_t(N));
+	out.write(int64_t(V));
+	std::vector<double> sigma(N*V);
+	for (int i=0;i<N;i++) {
+		for (int j=0;j<V;j++) sigma[i*V+j] = diagonals[i][j];
+	}
+	out.write(sigma.data(), sigma.size());
+	const auto list = checkpoint_measurements();
+	out.write(int64_t(list.size()));
+	for (const auto &m : list) out.write(m.first, *m.second);
+}
+
+// Schur complement M_xx - M_xS Minv M_Sx of the pending block S extended by x,
+// leaving Minv M_Sx in u and M_xS Minv in w for accept_update
+double Simulation::schur_complement (const Matrix_d &M, const Matrix_d &Minv, int x, Vector_d &u, Vector_d &w) {
+	const int L = update_size;
+	if (L==0) return M(x, x);
+	for (int i=0;i<L;i++) {
+		update_col[i] = M(update_perm[i], x);
+		update_row[i] = M(x, update_perm[i]);
+	}
+	u.head(L).noalias() = Minv.topLeftCorner(L, L) * update_col.head(L);
+	w.head(L).noalias() = Minv.topLeftCorner(L, L).transpose() * update_row.head(L);
+	return M(x, x) - update_row.head(L).dot(u.head(L));
+}
+
+void Simulation::swap_update_positions (int i, int j) {
+	if (i==j) return;
+	const int L = std::max(i, j)+1;
+	std::swap(update_perm[i], update_perm[j]);
+	update_pos[update_perm[i]] = i;
+	update_pos[update_perm[j]] = j;
+	update_inverse_up.row(i).head(L).swap(update_inverse_up.row(j).head(L));
+	update_inverse_up.col(i).head(L).swap(update_inverse_up.col(j).head(L));
+	update_inverse_dn.row(i).head(L).swap(update_inverse_dn.row(j).head(L));
+	update_inverse_dn.col(i).head(L).swap(update_inverse_dn.col(j).head(L));
+}
+
+static void grow_inverse (Matrix_d &Minv, const Vector_d &u, const Vector_d &w, double s, int L) {
+	Minv.topLeftCorner(L, L).noalias() += u.head(L) * w.head(L).transpose() / s;
+	Minv.col(L).head(L) = -u.head(L) / s;
+	Minv.row(L).head(L) = -w.head(L).transpose() / s;
+	Minv(L, L) = 1.0 / s;
+}
+
+static void shrink_inverse (Matrix_d &Minv, Vector_d &u, Vector_d &w, int n) {
+	u.head(n) = Minv.col(n).head(n);
+	w.head(n) = Minv.row(n).head(n).transpose();
+	Minv.topLeftCorner(n, n).noalias() -= u.head(n) * w.head(n).transpose() / Minv(n, n);
+}
+
+// updates the inverses of the pending blocks after the proposal of
+// rank1_probability has been accepted
+void Simulation::accept_update () {
+	const int L = update_size;
+	const int j = update_pos[update_site];
+	if (new_update_size>L) {
+		std::swap(update_perm[j], update_perm[L]);
+		update_pos[update_perm[j]] = j;
+		update_pos[update_perm[L]] = L;
+		grow_inverse(update_inverse_up, update_u_up, update_w_up, update_schur_up, L);
+		grow_inverse(update_inverse_dn, update_u_dn, update_w_dn, update_schur_dn, L);
+	} else {
+		swap_update_positions(j, L-1);
+		shrink_inverse(update_inverse_up, update_u_up, update_w_up, L-1);
+		shrink_inverse(update_inverse_dn, update_u_dn, update_w_dn, L-1);
+	}
+	update_size = new_update_size;
+	if (max_update_size>0 && update_size>=max_update_size) flush_updates();
+}
+
+// folds the pending flips into rho_up and rho_dn with one rank-k update
+// (Woodbury, the pending block of the update matrix is the capacitance
+// matrix) and starts a new block; the diagonals are only changed at the
+// next shift, since the stored decompositions still use the old fields
+void Simulation::flush_updates () {
+	const int L = update_size;
+	if (L==0) return;
+	PROFILE_SCOPE(profile, Flush, 8.0*V*V*L);
+	Vector_d c = -2.0*(current_diagonal().array().inverse()+1.0).inverse().matrix();
+	update_X.resize(V, L);
+	update_Y.resize(L, V);
+	// rho_up += rho_up[:,S] Minv_up C_S (I-rho_up)[S,:]
+	for (int i=0;i<L;i++) {
+		const int x = update_perm[i];
+		update_X.col(i) = rho_up.col(x);
+		update_Y.row(i) = -c[x]*rho_up.row(x);
+		update_Y(i, x) += c[x];
+	}
+	update_Z.noalias() = update_inverse_up.topLeftCorner(L, L) * update_Y;
+	rho_up.noalias() += update_X * update_Z;
+	// rho_dn -= (I-rho_dn)[:,S] Minv_dn C_S rho_dn[S,:]
+	for (int i=0;i<L;i++) {
+		const int x = update_perm[i];
+		update_X.col(i) = -rho_dn.col(x);
+		update_X(x, i) += 1.0;
+		update_Y.row(i) = c[x]*rho_dn.row(x);
+	}
+	update_Z.noalias() = update_inverse_dn.topLeftCorner(L, L) * update_Y;
+	rho_dn.noalias() -= update_X * update_Z;
+	for (int i=0;i<L;i++) update_flushed[update_perm[i]] ^= 1;
+	plog += update_prob;
+	psign *= update_sign;
+	flushes++;
+	reset_updates();
+	make_update_matrices();
+}
+
+// ratio of the determinants of the pending blocks with and without x,
+// from the stored inverses: O(L^2) to add a site, O(1) to remove it
 std::pair<double, double> Simulation::rank1_probability (int x) {
-	int L = update_size;
-	int j;
+	const int L = update_size;
+	const int j = update_pos[x];
 	double d1, d2;
-	for (j=0;j<V;j++) {
-		if (update_perm[j]==x) break;
-	}
+	PROFILE_SCOPE(profile, Rank1, j>=L?8.0*L*L:0.0);
+	update_site = x;
 	if (j>=L) {
-		std::swap(update_perm[j], update_perm[L]);
 		new_update_size = update_size+1;
-		update_matrix_up.col(j).swap(update_matrix_up.col(L));
-		update_matrix_up.row(j).swap(update_matrix_up.row(L));
-		d1 = update_matrix_up.topLeftCorner(L+1, L+1).determinant();
-		update_matrix_dn.col(j).swap(update_matrix_dn.col(L));
-		update_matrix_dn.row(j).swap(update_matrix_dn.row(L));
-		d2 = update_matrix_dn.topLeftCorner(L+1, L+1).determinant();
+		d1 = update_schur_up = schur_complement(update_matrix_up, update_inverse_up, x, update_u_up, update_w_up);
+		d2 = update_schur_dn = schur_complement(update_matrix_dn, update_inverse_dn, x, update_u_dn, update_w_dn);
 	} else {
-		std::swap(update_perm[j], update_perm[L-1]);
 		new_update_size = update_size-1;
-		update_matrix_up.col(j).swap(update_matrix_up.col(L-1));
-		update_matrix_up.row(j).swap(update_matrix_up.row(L-1));
-		d1 = update_matrix_up.topLeftCorner(L-1, L-1).determinant();
-		update_matrix_dn.col(j).swap(update_matrix_dn.col(L-1));
-		update_matrix_dn.row(j).swap(update_matrix_dn.row(L-1));
-		d2 = update_matrix_dn.topLeftCorner(L-1, L-1).determinant();
-	}
-	double s = 1.0;
+		d1 = update_inverse_up(j, j);
+		d2 = update_inverse_dn(j, j);
+	}
+	double s = update_sign;
 	if (d1 < 0) {
 		s *= -1.0;
 		d1 *= -1.0;
@@ -357,10 +650,11 @@ std::pair<double, double> Simulation::rank1_probability (int x) {
 		s *= -1.0;
 		d2 *= -1.0;
 	}
-	return std::pair<double, double>(std::log(d1)+std::log(d2), s);
+	return std::pair<double, double>(update_prob+std::log(d1)+std::log(d2), s);
 }
 
 bool Simulation::metropolis () {
+	PROFILE_SCOPE(profile, Metropolis, 0.0);
 	steps++;
 	bool ret = false;
 	int x = randomPosition(generator);
@@ -368,9 +662,9 @@ bool Simulation::metropolis () {
 	ret = -trialDistribution(generator)<r1.first-update_prob;
 	if (ret) {
 		//std::cerr << "accepted " << x << ' ' << update_size << std::endl;
-		update_size = new_update_size;
 		update_prob = r1.first;
 		update_sign = r1.second;
+		accept_update();
 		//std::cerr << "accepted metropolis step" << std::endl;
 	} else {
 		//std::cerr << "rejected metropolis step" << std::endl;
@@ -579,7 +873,8 @@ void Simulation::measure_sign () {
 }
 
 void Simulation::measure_quick () {
-	double s = svd_sign();
+	PROFILE_SCOPE(profile, Measure, 0.0);
+	double s = psign*update_sign;
 	double n_up = rho_up.diagonal().array().sum();
 	double n_dn = rho_dn.diagonal().array().sum();
 	double n2 = (rho_up.diagonal().array()*rho_dn.diagonal().array()).sum();
@@ -609,9 +904,8 @@ void Simulation::measure_quick () {
 }
 
 void Simulation::measure () {
-	double s = svd_sign();
-	rho_up = Matrix_d::Identity(V, V) - svdA.inverse();
-	rho_dn = svdB.inverse();
+	PROFILE_SCOPE(profile, Measure, 0.0);
+	double s = psign*update_sign;
 	double K_up = get_kinetic_energy(rho_up);
 	double K_dn = get_kinetic_energy(rho_dn);
 	double n_up = rho_up.diagonal().array().sum();
@@ -631,78 +925,153 @@ void Simulation::measure () {
 		d_up[i].add(s*rho_up(i, i));
 		d_dn[i].add(s*rho_dn(i, i));
 	}
-	double d_wave_chi = pair_correlation(rho_up, rho_dn);
-	Matrix_d F_up = svdA.inverse();
-	Matrix_d F_dn = Matrix_d::Identity(V, V) - svdB.inverse();
+	Eigen::ArrayXd c_spin, c_density, c_pair, q;
+	correlations.spin_density(rho_up, rho_dn, c_spin, c_density);
+	correlations.d_wave(rho_up, rho_dn, c_pair);
+	double d_wave_chi = c_pair.sum()/V;
 	chi_d.add(s*d_wave_chi*beta);
 	double af_ =((rho_up.diagonal().array()-rho_dn.diagonal().array())*staggering).sum()/double(V);
 	chi_af.add(s*beta*af_*af_);
 	for (int k=1;k<=Lx/2;k++) {
-		double ssz = 0.0;
-		for (int j=0;j<V;j++) {
-			int x = j;
-			int y = shift_x(j, k);
-			ssz += rho_up(x, x)*rho_up(y, y) + rho_dn(x, x)*rho_dn(y, y);
-			ssz -= rho_up(x, x)*rho_dn(y, y) + rho_dn(x, x)*rho_up(y, y);
-			ssz -= rho_up(x, y)*rho_up(y, x) + rho_dn(x, y)*rho_dn(y, x);
-		}
-		spincorrelation[k].add(s*0.25*ssz);
-		if (isnan(ssz)) {
-		}
+		spincorrelation[k].add(s*V*c_spin[k*Ly*Lz]);
 	}
+	spin_r.add(s*c_spin);
+	density_r.add(s*c_density);
+	pair_r.add(s*c_pair);
+	correlations.structure_factor(c_spin, q);
+	spin_q.add(s*q);
+	correlations.structure_factor(c_density, q);
+	density_q.add(s*q);
+	correlations.structure_factor(c_pair, q);
+	pair_q.add(s*q);
 	//if (staggered_field!=0.0) staggered_magnetization.add(s*(rho_up.diagonal().array()*staggering - rho_dn.diagonal().array()*staggering).sum()/V);
 	get_green_function(s);
 }
 
-void Simulation::get_green_function (double s, int t0) {
-	double X = 1.0-A*A;
-	Matrix_d rho_up = Matrix_d::Identity(V, V) - svdA.inverse();
-	Matrix_d rho_dn = svdB.inverse();
-	SVDHelper help, flist[N+1], blist[N+1];
-	// spin up
-	help.setIdentity(V);
-	for (int t=0;t<=N;t++) {
-		flist[t] = help;
-		help.U.applyOnTheLeft(freePropagator_matrix);
-		help.S *= std::exp(+dt*B*0.5+dt*mu);
-		help.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonals[(t+t0)%N]).array()).matrix().asDiagonal());
-		help.absorbU();
+// the spin down chain measures G(tau, 0) = (B(tau, 0)^-1 + B(beta, tau))^-1,
+// the spin up chain keeps the particle-hole convention of the updater,
+// (B(beta, tau)^-1 + B(tau, 0))^-1, which at tau=0 is 1-(1+B(beta, 0))^-1.
+// Both come from the stabilized block products at the block boundaries and
+// by multiplying on single slices inside a block. At a block boundary of
+// the updater its stack is valid and supplies B(tau_b, 0) below and
+// B(beta, tau_b) above the current block, only the rest is recomputed
+void Simulation::get_green_function (double s) {
+	if (gf_name.empty() || gf_interval<1 || (gf_calls++)%gf_interval!=0) return;
+	PROFILE_SCOPE(profile, GreenFunction, 0.0);
+	const int nb = svd_bounds.size()-1;
+	const int start = svd_block_start(time_shift);
+	const bool reuse = svd_stack_valid && start>=0 && update_size==0
+		&& (int)svd_left.size()==nb+1 && (int)svd_right.size()==nb+1;
+	const int c = reuse?start:0;
+	gf_left.resize(nb+1);
+	gf_right.resize(nb+1);
+	if (reuse) {
+		for (int b=0;b<=c;b++) gf_left[b] = svd_left[b];
+		for (int b=c;b<=nb;b++) gf_right[b] = svd_right[b];
+	} else {
+		gf_left[0].setMethod(decomposition);
+		gf_left[0].setDriver(svd.driver);
+		gf_left[0].setIdentity(V);
+		gf_right[nb] = gf_left[0];
 	}
-	help.setIdentity(V);
-	for (int t=0;t<=N;t++) {
-		blist[t] = help;
-		help.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)-diagonals[(t+t0)%N]).array()).matrix().asDiagonal());
-		help.S *= std::exp(-dt*B*0.5-dt*mu)/X;
-		help.U.applyOnTheLeft(freePropagator_inverse);
-		help.absorbU();
+	for (int b=c+1;b<=nb;b++) {
+		block_matrix.setIdentity(V, V);
+		apply_slices(block_matrix, svd_bounds[b-1], svd_bounds[b]);
+		gf_left[b] = gf_left[b-1];
+		gf_left[b].U.applyOnTheLeft(block_matrix);
+		gf_left[b].absorbU();
 	}
-	for (int t=0;t<=N;t++) {
-		help = blist[N-t];
-		help.add_svd(flist[t]);
-		green_function_up[t].add(s*help.inverse());
+	for (int b=(reuse?c:nb)-1;b>=0;b--) {
+		block_matrix.setIdentity(V, V);
+		apply_slices(block_matrix, svd_bounds[b], svd_bounds[b+1]);
+		gf_right[b] = gf_right[b+1];
+		gf_right[b].Vt.applyOnTheRight(block_matrix);
+		gf_right[b].absorbVt();
 	}
-	// spin down
-	help.setIdentity(V);
-	for (int t=0;t<=N;t++) {
-		flist[t] = help;
-		help.U.applyOnTheLeft(freePropagator_matrix);
-		help.S *= std::exp(-dt*B*0.5+dt*mu);
-		help.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonals[(t+t0)%N]).array()).matrix().asDiagonal());
-		help.absorbU();
+	spin_tasks.run([&] () {
+		green_function_chain(s, +0.5*B+mu, true, gf_help_up, gf_tmp_up, gf_up, momentumSpace, green_function_up);
+	}, [&] () {
+		green_function_chain(s, -0.5*B+mu, false, gf_help_dn, gf_tmp_dn, gf_dn, momentumSpace_dn, green_function_dn);
+	});
+}
+
+// one spin species, h is the scalar part of the slices (Zeeman term and
+// chemical potential); the particle-hole chain swaps the roles of the left
+// and right products, so inside a block it goes on as G B^-1 instead of B G
+void Simulation::green_function_chain (double s, double h, bool particle_hole,
+		SVDHelper &help, SVDHelper &tmp, Matrix_d &G, Matrix_cd &buffer,
+		std::vector<mymeasurement<Eigen::ArrayXXd>> &out) {
+	const int nb = gf_left.size()-1;
+	Eigen::ArrayXXd g;
+	for (int b=0;b<=nb;b++) {
+		const int t = svd_bounds[b];
+		help = particle_hole?gf_right[b]:gf_left[b];
+		help.S *= std::exp((particle_hole?N-t:t)*dt*h);
+		help.invertInPlace();
+		tmp = particle_hole?gf_left[b]:gf_right[b];
+		tmp.S *= std::exp((particle_hole?t:N-t)*dt*h);
+		help.add_svd(tmp);
+		G = help.inverse();
+		add_green_function(out[t], s, G, g);
+		for (int k=t+1;k<(b<nb?svd_bounds[b+1]:N);k++) {
+			if (particle_hole) {
+				remove_slice(G, k-1, buffer);
+				G *= std::exp(-dt*h);
+			} else {
+				apply_slices(G, k-1, k, buffer);
+				G *= std::exp(dt*h);
+			}
+			add_green_function(out[k], s, G, g);
+		}
 	}
-	help.setIdentity(V);
-	for (int t=0;t<=N;t++) {
-		blist[t] = help;
-		help.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)-diagonals[(t+t0)%N]).array()).matrix().asDiagonal());
-		help.S *= std::exp(+dt*B*0.5-dt*mu)/X;
-		help.U.applyOnTheLeft(freePropagator_inverse);
-		help.absorbU();
+}
+
+void Simulation::add_green_function (mymeasurement<Eigen::ArrayXXd> &m, double s, const Matrix_d &G, Eigen::ArrayXXd &g) const {
+	if (gf_reduced) {
+		reduce_green_function(G, g);
+		m.add(s*g);
+	} else {
+		m.add(s*G);
 	}
-	for (int t=0;t<=N;t++) {
-		help = flist[N-t];
-		help.add_svd(blist[t]);
-		green_function_dn[t].add(s*help.inverse());
+}
+
+// G(r) = 1/V sum_x G(x+r, x), then averaged over the point group orbit of r
+void Simulation::reduce_green_function (const Matrix_d &G, Eigen::ArrayXXd &g) const {
+	Eigen::ArrayXd sum;
+	correlations.translation_sum(G, sum);
+	g.setZero(V, 1);
+	for (const std::vector<int> &p : gf_symmetries) {
+		for (int r=0;r<V;r++) g(r, 0) += sum[p[r]];
 	}
+	g /= double(gf_symmetries.size());
+}
+
+// displacement permutations of the lattice point group: reflections of each
+// direction and exchanges of equivalent directions (same length and hopping)
+void Simulation::prepare_symmetries () {
+	const int L[] = { Lx, Ly, Lz };
+	const double t[] = { tx, ty, tz };
+	int perm[] = { 0, 1, 2 };
+	gf_symmetries.clear();
+	do {
+		bool ok = true;
+		for (int i=0;i<3;i++) ok = ok && L[perm[i]]==L[i] && t[perm[i]]==t[i];
+		if (!ok) continue;
+		for (int mask=0;mask<8;mask++) {
+			if ((mask&2 && Ly<2) || (mask&4 && Lz<2) || (mask&1 && Lx<2)) continue;
+			std::vector<int> p(V);
+			for (int r=0;r<V;r++) {
+				int c[] = { (r/Lz/Ly)%Lx, (r/Lz)%Ly, r%Lz };
+				int d[3];
+				for (int i=0;i<3;i++) {
+					d[i] = c[perm[i]];
+					if (mask&(1<<i)) d[i] = (L[i]-d[i])%L[i];
+				}
+				p[r] = d[0]*Ly*Lz + d[1]*Lz + d[2];
+			}
+			gf_symmetries.push_back(p);
+		}
+	} while (std::next_permutation(perm, perm+3));
 }
 
 void Simulation::write_green_function () {
@@ -718,6 +1087,7 @@ void Simulation::write_green_function () {
 	out << "Ly = " << Ly << "\n";
 	out << "Lz = " << Lz << "\n";
 	out << "N = " << N << "\n";
+	out << "reduced = " << (gf_reduced?"true":"false") << " -- G[t][r] with r = rx*Ly*Lz+ry*Lz+rz, symmetrized\n";
 	out << "sign = " << sign.mean() << "\n";
 	out << "Dsign = " << sign.error() << "\n";
 	out << "G_up = {}\n";
@@ -738,6 +1108,31 @@ void Simulation::write_green_function () {
 	}
 }
 
+// C(r) and S(q) with r, q = x*Ly*Lz+y*Lz+z, q in units of 2pi/L
+void Simulation::write_correlations () {
+	if (corr_name.empty()) return;
+	std::ofstream out(corr_name);
+	Eigen::IOFormat HeavyFmt(Eigen::FullPrecision, 0, ", ", ",\n", "{", "}", "{", "}");
+	out << "beta = " << beta*tx << "\n";
+	out << "U = " << g/tx << "\n";
+	out << "Lx = " << Lx << "\n";
+	out << "Ly = " << Ly << "\n";
+	out << "Lz = " << Lz << "\n";
+	out << "sign = " << sign.mean() << "\n";
+	out << "Dsign = " << sign.error() << "\n";
+	const std::pair<const char*, const mymeasurement<Eigen::ArrayXXd>*> list[] = {
+		{ "spin_r", &spin_r }, { "density_r", &density_r }, { "pair_r", &pair_r },
+		{ "spin_q", &spin_q }, { "density_q", &density_q }, { "pair_q", &pair_q },
+	};
+	for (const auto &m : list) {
+		if (m.second->samples()==0) continue;
+		Eigen::ArrayXXd C = m.second->mean()/sign.mean();
+		Eigen::ArrayXXd DC = C.abs()*(m.second->error()/m.second->mean().abs() + sign.error()/fabs(sign.mean()));
+		out << m.first << " = " << C.format(HeavyFmt) << std::endl;
+		out << "D" << m.first << " = " << DC.format(HeavyFmt) << std::endl;
+	}
+}
+
 bool Simulation::shift_time () {
 	bool ret = time_shift==N-1;
 	if (time_shift%5) {
@@ -756,42 +1151,155 @@ bool Simulation::shift_time () {
 	return ret;
 }
 
+// multiplies the slices lo to hi-1 (not shifted) onto A from the left,
+// using buffer as FFT scratch
+void Simulation::apply_slices (Matrix_d &A, int lo, int hi, Matrix_cd &buffer) {
+	PROFILE_SCOPE(profile, Propagation, (hi-lo)*propagation_flops());
+	for (int k=lo;k<hi;k++) {
+		A.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonals[k]).array()).matrix().asDiagonal());
+		if (!use_fft) {
+			apply_propagator(A);
+		} else {
+			fftw_execute_dft_r2c(x2p_col, A.data(), reinterpret_cast<fftw_complex*>(buffer.data()));
+			buffer.applyOnTheLeft((freePropagator_diagonal/double(V)).asDiagonal());
+			fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(buffer.data()), A.data());
+		}
+	}
+}
+
+// multiplies the inverse of slice k (not shifted) onto A from the right
+void Simulation::remove_slice (Matrix_d &A, int k, Matrix_cd &buffer) {
+	PROFILE_SCOPE(profile, Propagation, propagation_flops());
+	A.applyOnTheRight((Vector_d::Constant(V, 1.0)+diagonals[k]).array().inverse().matrix().asDiagonal());
+	if (!use_fft) {
+		apply_inverse_propagator_right(A);
+	} else {
+		A.transposeInPlace();
+		fftw_execute_dft_r2c(x2p_col, A.data(), reinterpret_cast<fftw_complex*>(buffer.data()));
+		buffer.applyOnTheLeft((freePropagator_diagonal.array().inverse().matrix()/double(V)).asDiagonal());
+		fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(buffer.data()), A.data());
+		A.transposeInPlace();
+	}
+}
+
+// block_matrix = B(hi, lo) for a block of the stack, in single precision
+// when mixed_precision is set; returns whether it was
+bool Simulation::block_product (int lo, int hi) {
+	block_matrix.setIdentity(V, V);
+	if (single_precision()) {
+		PROFILE_SCOPE(profile, Propagation, (hi-lo)*propagation_flops());
+		apply_slices_f(block_matrix, lo, hi, 0);
+		return true;
+	}
+	apply_slices(block_matrix, lo, hi);
+	return false;
+}
+
+// rebuilds the right stack from the current fields, to be called at time_shift==0.
+// The blocks of this sweep are svd_block() slices long, and every absorbed
+// block feeds the growth of the spread back into svd_schedule. A single
+// precision block whose logdet is off is done again in double
+void Simulation::make_svd_stack () {
+	const int len = svd_block();
+	svd_bounds.clear();
+	for (int t=0;t<N;t+=len) svd_bounds.push_back(t);
+	svd_bounds.push_back(N);
+	const int nb = svd_bounds.size()-1;
+	svd_left.resize(nb+1);
+	svd_right.resize(nb+1);
+	svd_right[nb].setMethod(decomposition);
+	svd_right[nb].setDriver(svd.driver);
+	svd_right[nb].setIdentity(V);
+	svd_schedule.start(0.0);
+	for (int b=nb-1;b>=0;b--) {
+		const int lo = svd_bounds[b], hi = svd_bounds[b+1];
+		const bool single = block_product(lo, hi);
+		svd_right[b] = svd_right[b+1];
+		svd_right[b].Vt.applyOnTheRight(block_matrix);
+		svd_right[b].absorbVt();
+		if (single && !check_mixed_precision(svd_right[b].S.array().log().sum()-svd_right[b+1].S.array().log().sum()-slices_logdet_f(lo, hi))) {
+			b++; // the same block again, now in double
+		} else {
+			svd_schedule.update(StabilizationSchedule::spread(svd_right[b].S), (hi-lo)*dt);
+		}
+	}
+	svd_schedule.start(0.0); // the left stack starts from the identity
+	svd_left[0] = svd_right[nb];
+	svd = svd_right[0];
+	svd_stack_valid = true;
+}
+
+// block b-1 has been swept: push it on the left stack and start block b
+void Simulation::advance_svd_stack (int b) {
+	const int lo = svd_bounds[b-1], hi = svd_bounds[b];
+	const bool single = block_product(lo, hi);
+	svd_left[b] = svd_left[b-1];
+	svd_left[b].U.applyOnTheLeft(block_matrix);
+	svd_left[b].absorbU();
+	if (single && !check_mixed_precision(svd_left[b].S.array().log().sum()-svd_left[b-1].S.array().log().sum()-slices_logdet_f(lo, hi))) {
+		advance_svd_stack(b);
+		return;
+	}
+	svd_schedule.update(StabilizationSchedule::spread(svd_left[b].S), (hi-lo)*dt);
+	svd.product(svd_left[b], svd_right[b]);
+}
+
+// inside a block the Green functions are wrapped by one slice, G -> B G B^-1,
+// and only at the block boundaries the decomposition is rebuilt from the
+// stack, so that a sweep costs O(N/svd_block()) decompositions. The weight does not
+// change under the wrap; svd and svdA/svdB are stale until the next boundary
 bool Simulation::shift_time_svd () {
 	bool ret = time_shift==N-1;
-	if (time_shift%5>0 && false) {
-		remove_first_slice(svd.Vt);
-		svd.absorbVt();
+	const int next = time_shift+1;
+	if (svd_stack_valid && next<N && svd_block_start(next)<0) {
+		flush_updates();
 		apply_updates();
-		queue_first_slice(svd.U);
-		svd.absorbU();
+		wrap_green_functions();
 		time_shift++;
-		svdA = svd;
-		svdA.add_identity(std::exp(+beta*B*0.5+beta*mu));
-		svdB = svd;
-		svdB.add_identity(std::exp(-beta*B*0.5+beta*mu));
-		rho_up = Matrix_d::Identity(V, V) - svdA.inverse();
-		update_matrix_up = rho_up;
-		update_matrix_up.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_up.diagonal() += Vector_d::Ones(V);
-		rho_dn = svdB.inverse();
-		update_matrix_dn = Matrix_d::Identity(V, V) - rho_dn;
-		update_matrix_dn.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_dn.diagonal() += Vector_d::Ones(V);
-		plog = svd_probability();
-		psign = svd_sign();
 		reset_updates();
+		make_update_matrices();
 	} else {
 		apply_updates();
-		time_shift++;
-		redo_all_svd();
+		time_shift = next%N;
+		if (time_shift==0) {
+			make_svd_stack();
+			redo_all_svd(false);
+		} else if (svd_stack_valid) {
+			advance_svd_stack(svd_block_start(time_shift));
+			redo_all_svd(false);
+		} else {
+			redo_all_svd();
+		}
 	}
-	time_shift = time_shift%N;
 	return ret;
 }
 
 
+// replaces the fields and recomputes the weight from scratch
+void Simulation::set_fields (const std::vector<Vector_d> &f) {
+	for (int t=0;t<N;t++) {
+		for (int x=0;x<V;x++) diagonals[t][x] = f[t][x]<0.0?-A:A;
+	}
+	refresh_fields();
+}
+
+// after the fields changed behind the updater's back: the stack is rebuilt
+// right away at time_shift==0, otherwise when the sweep wraps around
+void Simulation::refresh_fields () {
+	valid_slices.assign(valid_slices.size(), false);
+	if (time_shift==0) {
+		make_svd_stack();
+		std::tie(plog, psign) = make_svd_inverse(false);
+	} else {
+		svd_stack_valid = false;
+		std::tie(plog, psign) = make_svd_inverse();
+	}
+	reset_updates();
+}
+
 void Simulation::accumulate_forward (int start, int end, Matrix_d &G_up, Matrix_d &G_dn) {
 	while (end>N) end -= N;
+	spin_tasks.run([&] () {
 	for (int i=start;i<end;i++) {
 		G_up.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonals[i]).array()).matrix().asDiagonal());
 		if (false) {
@@ -803,17 +1311,19 @@ void Simulation::accumulate_forward (int start, int end, Matrix_d &G_up, Matrix_
 			fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), G_up.data());
 		}
 	}
+	}, [&] () {
 	for (int i=start;i<end;i++) {
 		G_dn.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonals[i]).array()).matrix().asDiagonal());
 		if (false) {
 			G_dn.applyOnTheLeft(freePropagator_matrix);
 		} else {
 			G_dn.applyOnTheLeft(freePropagator_x.array().inverse().matrix().asDiagonal());
-			fftw_execute_dft_r2c(x2p_col, G_dn.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
-			momentumSpace.applyOnTheLeft((freePropagator_diagonal.array().inverse().matrix()/double(V)).asDiagonal());
-			fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), G_dn.data());
+			fftw_execute_dft_r2c(x2p_col, G_dn.data(), reinterpret_cast<fftw_complex*>(momentumSpace_dn.data()));
+			momentumSpace_dn.applyOnTheLeft((freePropagator_diagonal.array().inverse().matrix()/double(V)).asDiagonal());
+			fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace_dn.data()), G_dn.data());
 		}
 	}
+	});
 }
 
 void Simulation::make_slice (int i) {
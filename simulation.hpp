@@ -4,12 +4,21 @@
 #include "config.hpp"
 
 #include "svd.hpp"
+#include "accumulator.hpp"
 #include "types.hpp"
 #include "measurements.hpp"
+#include "spin_tasks.hpp"
+#include "checkerboard.hpp"
+#include "correlations.hpp"
+#include "profiler.hpp"
+#include "checkpoint.hpp"
 
 #include <fstream>
 #include <random>
 #include <iostream>
+#include <algorithm>
+
+class CheckpointWriter;
 
 extern "C" {
 #include <fftw3.h>
@@ -46,6 +55,42 @@ static auto measurements_proto = make_named_tuple(
 typedef decltype(measurements_proto) measurements_type;
 #endif
 
+// the settings of a Simulation as given in its task table, read once so that
+// simulations can be set up on worker threads without a Lua state
+struct SimulationParameters {
+	config::hubbard_config config;
+	bool seeded;
+	lua_Integer seed;
+	std::string seed_state; // a saved generator, used instead of seed
+	double w_x, w_y, w_z;
+	bool reset;
+	std::string outfn;
+	std::string gf_name;
+	std::string corr_name;
+	bool gf_reduced;
+	int gf_interval;
+	int mslices;
+	int msvd;
+	int flips_per_update;
+	bool use_fft;
+	bool use_checkerboard;
+	SVDHelper::Method decomposition;
+	std::string svd_driver;
+	bool mixed_precision;
+	double mixed_precision_threshold;
+	bool adaptive_svd;
+	int max_update_size;
+	bool parallel_spins;
+
+	void read (lua_State *L, int index);
+
+	void setSeed (lua_Integer s) {
+		seeded = true;
+		seed = s;
+		seed_state.clear();
+	}
+};
+
 class Simulation {
 	private:
 
@@ -78,6 +123,17 @@ class Simulation {
 	int msvd;
 	int flips_per_update;
 	bool use_fft;
+	bool use_checkerboard; // sparse exp(-dt*K) from bond families instead of the dense propagator
+	Checkerboard checkerboard;
+	SVDHelper::Method decomposition;
+	std::string svd_driver;
+	bool mixed_precision; // multiply the slices between stabilizations in single precision
+	double mixed_precision_threshold; // logdet error that switches back to double
+	bool adaptive_svd; // choose the number of slices between SVDs from the growth of the scales
+	int max_update_size; // pending flips folded into rho with one rank-k update, 0 to wait for the shift
+	bool parallel_spins; // run the spin up and down chains on two threads
+	SpinTasks spin_tasks;
+	StabilizationSchedule svd_schedule;
 
 
 	// RNG distributions
@@ -89,6 +145,9 @@ class Simulation {
 	Vector_d freePropagator_diagonal;
 	Matrix_d freePropagator_matrix;
 	Matrix_d freePropagator_inverse;
+	Matrix_f freePropagator_matrix_f;
+	double free_logdet;
+	double free_logdet_f;
 	double w_x, w_y, w_z;
 	Vector_d potential;
 	Vector_d freePropagator_x;
@@ -97,6 +156,9 @@ class Simulation {
 
 	Matrix_d positionSpace; // current matrix in position space
 	Matrix_cd momentumSpace; // current matrix in momentum space
+	Matrix_cd momentumSpace_dn; // same for the spin down chain when it runs concurrently
+	Matrix_f slices_f;
+	Matrix_f slices_tmp_f;
 
 	std::vector<Matrix_d> slices_up;
 	std::vector<Matrix_d> slices_dn;
@@ -108,8 +170,23 @@ class Simulation {
 	int new_update_size;
 	//std::vector<bool> update_flips;
 	std::vector<int> update_perm;
+	std::vector<int> update_pos; // inverse of update_perm
+	std::vector<char> update_flushed; // flips already folded into rho but not yet into the diagonals
 	Matrix_d update_matrix_up;
 	Matrix_d update_matrix_dn;
+	Matrix_d update_inverse_up; // inverse of the pending block of update_matrix_up
+	Matrix_d update_inverse_dn;
+	Vector_d update_u_up, update_w_up;
+	Vector_d update_u_dn, update_w_dn;
+	Vector_d update_col;
+	Vector_d update_row;
+	Matrix_d update_X;
+	Matrix_d update_Y;
+	Matrix_d update_Z;
+	double update_schur_up;
+	double update_schur_dn;
+	int update_site;
+	int flushes;
 
 	Matrix_d hamiltonian;
 	Matrix_d eigenvectors;
@@ -126,6 +203,30 @@ class Simulation {
 	SVDHelper svdA;
 	SVDHelper svdB;
 
+	// partial products for shift_time_svd, one entry per block of slices:
+	// svd_left[b] holds the slices below block b (already updated in this
+	// sweep) and svd_right[b] the slices from block b to N-1. Block b starts
+	// at slice svd_bounds[b], the last entry is N; the blocks are svd_block()
+	// slices long as of the start of the sweep
+	std::vector<SVDHelper> svd_left;
+	std::vector<SVDHelper> svd_right;
+	std::vector<int> svd_bounds;
+	bool svd_stack_valid;
+	Matrix_d block_matrix;
+
+	// arena of the unequal time Green function: B(tau_b, 0) and, when the
+	// updater's stack cannot be used, B(beta, tau_b) at the block boundaries
+	std::vector<SVDHelper> gf_left;
+	std::vector<SVDHelper> gf_right;
+	SVDHelper gf_help_up, gf_tmp_up;
+	SVDHelper gf_help_dn, gf_tmp_dn;
+	Matrix_d gf_up, gf_dn;
+	int gf_interval; // unequal time Green function every gf_interval calls of measure()
+	int gf_calls;
+	bool gf_reduced; // store G(r, tau) averaged over translations and the point group
+	bool translation_invariant;
+	std::vector<std::vector<int>> gf_symmetries;
+
 	fftw_plan x2p_col;
 	fftw_plan p2x_col;
 
@@ -138,6 +239,7 @@ class Simulation {
 	public:
 
 	int steps;
+	PhaseProfile profile; // filled with -DPROFILE_PHASES only
 
 	mymeasurement<double> acceptance;
 	mymeasurement<double> density;
@@ -156,6 +258,11 @@ class Simulation {
 	std::vector<mymeasurement<double>> d_up;
 	std::vector<mymeasurement<double>> d_dn;
 	std::vector<mymeasurement<double>> spincorrelation;
+	// correlations for all displacements r and structure factors for all q
+	mymeasurement<Eigen::ArrayXXd> spin_r, density_r, pair_r;
+	mymeasurement<Eigen::ArrayXXd> spin_q, density_q, pair_q;
+	CorrelationFunctions correlations;
+	std::string corr_name;
 	std::vector<mymeasurement<double>> error;
 	// RNG distributions
 	mymeasurement<double> staggered_magnetization;
@@ -164,6 +271,7 @@ class Simulation {
 	std::vector<mymeasurement<Eigen::ArrayXXd>> green_function_dn;
 
 	int time_shift;
+	int mixed_precision_fallbacks;
 
 	int shift_x (int x, int k) {
 		int a = (x/Ly/Lz)%Lx;
@@ -218,20 +326,57 @@ class Simulation {
 		update_sign = 1.0;
 		update_size = 0.0;
 		update_perm.resize(V);
-		for (int i=0;i<V;i++) update_perm[i] = i;
+		update_pos.resize(V);
+		for (int i=0;i<V;i++) update_perm[i] = update_pos[i] = i;
+		if (update_inverse_up.rows()!=V) {
+			update_inverse_up.setZero(V, V);
+			update_inverse_dn.setZero(V, V);
+			update_u_up.setZero(V);
+			update_w_up.setZero(V);
+			update_u_dn.setZero(V);
+			update_w_dn.setZero(V);
+			update_col.setZero(V);
+			update_row.setZero(V);
+		}
+	}
+
+	// current fields on slice 0, including the flips already flushed
+	Vector_d current_diagonal () const {
+		Vector_d ret = diagonal(0);
+		for (int x=0;x<V;x++) if (update_flushed[x]) ret[x] = -ret[x];
+		return ret;
+	}
+
+	void make_update_matrices () {
+		Vector_d c = -2.0*(current_diagonal().array().inverse()+1.0).inverse().matrix();
+		update_matrix_up = rho_up;
+		update_matrix_up.applyOnTheLeft(c.asDiagonal());
+		update_matrix_up.diagonal() += Vector_d::Ones(V);
+		update_matrix_dn = Matrix_d::Identity(V, V) - rho_dn;
+		update_matrix_dn.applyOnTheLeft(c.asDiagonal());
+		update_matrix_dn.diagonal() += Vector_d::Ones(V);
 	}
 
 	void init ();
 
 	void load (lua_State *L, int index);
+	void load (const SimulationParameters &p);
 	void save (lua_State *L, int index);
 	void load_checkpoint (lua_State *L);
 	void save_checkpoint (lua_State *L);
+	CheckpointStatus load_checkpoint (const std::string &fn, int &thermalization, int &sweeps);
+	bool save_checkpoint (const std::string &fn, int thermalization, int sweeps, const std::string &jobid);
+	void save_checkpoint (CheckpointWriter &out, int thermalization, int sweeps, const std::string &jobid);
+	std::vector<std::pair<const char*, mymeasurement<double>*>> checkpoint_measurements ();
 
 	Simulation (lua_State *L, int index) : distribution(0.5), trialDistribution(1.0), steps(0) {
 		load(L, index);
 	}
 
+	Simulation (const SimulationParameters &p) : distribution(0.5), trialDistribution(1.0), steps(0) {
+		load(p);
+	}
+
 	double logDetU_s (int x = -1, int t = -1) const {
 		int nspinup = 0;
 		for (int i=0;i<N;i++) {
@@ -250,19 +395,90 @@ class Simulation {
 	void make_slice (int i);
 	void make_slices ();
 
+	// free propagator on the dense path (no FFT): full matrix or checkerboard
+	void apply_propagator (Matrix_d &A) const {
+		if (use_checkerboard) checkerboard.applyLeft(A);
+		else A.applyOnTheLeft(freePropagator_matrix);
+	}
+
+	void apply_inverse_propagator (Matrix_d &A) const {
+		if (use_checkerboard) checkerboard.applyLeft(A, true);
+		else A.applyOnTheLeft(freePropagator_inverse);
+	}
+
+	void apply_inverse_propagator_right (Matrix_d &A) const {
+		if (use_checkerboard) checkerboard.applyRight(A, true);
+		else A.applyOnTheRight(freePropagator_inverse);
+	}
+
+	// multiplies the slices i+shift to j-1+shift onto U in single precision;
+	// only the dense propagator benefits, so this is not used together with
+	// the FFT or the checkerboard
+	void apply_slices_f (Matrix_d &U, int i, int j, int shift) {
+		slices_f = U.cast<float>();
+		for (;i<j;i++) {
+			slices_f.applyOnTheLeft((Vector_d::Constant(V, 1.0)+diagonals[(i+shift)%N]).cast<float>().asDiagonal());
+			slices_tmp_f.noalias() = freePropagator_matrix_f * slices_f;
+			slices_f.swap(slices_tmp_f);
+		}
+		U = slices_f.cast<double>();
+	}
+
+	bool single_precision () const {
+		return mixed_precision && !use_fft && !use_checkerboard;
+	}
+
+	// exact log|det| of the slices lo to hi-1 (not shifted) as multiplied
+	// by apply_slices_f
+	double slices_logdet_f (int lo, int hi) const {
+		double ret = (hi-lo)*free_logdet_f;
+		for (int k=lo;k<hi;k++) ret += (Vector_d::Constant(V, 1.0)+diagonals[k]).array().abs().log().sum();
+		return ret;
+	}
+
+	// the logdet of the product is known exactly, if the single precision
+	// products stray too far from it we go back to double for good
+	bool check_mixed_precision (double error) {
+		if (std::fabs(error)<mixed_precision_threshold) return true;
+		std::cerr << "mixed precision: logdet error " << error << ", switching to double precision" << std::endl;
+		mixed_precision = false;
+		mixed_precision_fallbacks++;
+		return false;
+	}
+
+	// number of slices to multiply before the next SVD, msvd unless adaptive_svd is set
+	int svd_block () const {
+		return std::max(1, int(svd_schedule.interval()/dt+0.5));
+	}
+
+	size_t stabilizations () const { return svd_schedule.stabilizations(); }
+
 	void make_svd () {
+		const bool single = single_precision();
 		svd.setIdentity(V);
+		svd_schedule.start(0.0);
 		for (int i=0;i<N;) {
-			svd.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(i)).array()).matrix().asDiagonal());
-			if (!use_fft) {
-				svd.U.applyOnTheLeft(freePropagator_matrix);
+			const int j = std::min(N, i+svd_block());
+			if (single) {
+				apply_slices_f(svd.U, i, j, time_shift);
 			} else {
-				fftw_execute_dft_r2c(x2p_col, svd.U.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
-				momentumSpace.applyOnTheLeft((freePropagator_diagonal/double(V)).asDiagonal());
-				fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), svd.U.data());
+				for (int k=i;k<j;k++) {
+					svd.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(k)).array()).matrix().asDiagonal());
+					if (!use_fft) {
+						apply_propagator(svd.U);
+					} else {
+						fftw_execute_dft_r2c(x2p_col, svd.U.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
+						momentumSpace.applyOnTheLeft((freePropagator_diagonal/double(V)).asDiagonal());
+						fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), svd.U.data());
+					}
+				}
 			}
-			i++;
-			if (i%msvd==0 || i==N) svd.absorbU();
+			svd.absorbU();
+			svd_schedule.update(StabilizationSchedule::spread(svd.S), (j-i)*dt);
+			i = j;
+		}
+		if (single && !check_mixed_precision(svd.S.array().log().sum()-logDetU_s()-N*free_logdet_f)) {
+			make_svd();
 		}
 	}
 
@@ -271,7 +487,7 @@ class Simulation {
 		for (int i=0;i<N;) {
 			plain.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(i)).array()).matrix().asDiagonal());
 			if (!use_fft) {
-				plain.applyOnTheLeft(freePropagator_matrix);
+				apply_propagator(plain);
 			} else {
 				fftw_execute_dft_r2c(x2p_col, plain.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
 				momentumSpace.applyOnTheLeft((freePropagator_diagonal/double(V)).asDiagonal());
@@ -282,11 +498,17 @@ class Simulation {
 	}
 
 	void make_svd_double () {
+		spin_tasks.run([this] () { make_svd_chain_up(); }, [this] () { make_svd_chain_dn(); });
+		svdA.add_identity(std::exp(+beta*B*0.5+beta*mu));
+		svdB.add_identity(std::exp(-beta*B*0.5+beta*mu));
+	}
+
+	void make_svd_chain_up () {
 		svdA.setIdentity(V);
 		for (int i=0;i<N;) {
 			svdA.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(i)).array()).matrix().asDiagonal());
 			if (!use_fft) {
-				svdA.U.applyOnTheLeft(freePropagator_matrix);
+				apply_propagator(svdA.U);
 			} else {
 				svdA.U.applyOnTheLeft(freePropagator_x.asDiagonal());
 				fftw_execute_dft_r2c(x2p_col, svdA.U.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
@@ -296,43 +518,46 @@ class Simulation {
 			i++;
 			if (i%msvd==0 || i==N) svdA.absorbU();
 		}
+	}
+
+	void make_svd_chain_dn () {
 		svdB.setIdentity(V);
 		for (int i=0;i<N;) {
 			svdB.U.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(i)).array()).matrix().asDiagonal());
 			if (!use_fft) {
-				svdB.U.applyOnTheLeft(freePropagator_inverse);
+				apply_inverse_propagator(svdB.U);
 			} else {
 				svdB.U.applyOnTheLeft(freePropagator_x.array().inverse().matrix().asDiagonal());
-				fftw_execute_dft_r2c(x2p_col, svdB.U.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
-				momentumSpace.applyOnTheLeft((freePropagator_diagonal.array().inverse().matrix()/double(V)).asDiagonal());
-				fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), svdB.U.data());
+				fftw_execute_dft_r2c(x2p_col, svdB.U.data(), reinterpret_cast<fftw_complex*>(momentumSpace_dn.data()));
+				momentumSpace_dn.applyOnTheLeft((freePropagator_diagonal.array().inverse().matrix()/double(V)).asDiagonal());
+				fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace_dn.data()), svdB.U.data());
 			}
 			i++;
 			if (i%msvd==0 || i==N) svdB.absorbU();
 		}
-		svdA.add_identity(std::exp(+beta*B*0.5+beta*mu));
-		svdB.add_identity(std::exp(-beta*B*0.5+beta*mu));
 	}
 
-	std::pair<double, double> make_density_matrices () {
-		make_svd();
-		svdA = svd;
-		svdA.add_identity(std::exp(+beta*B*0.5+beta*mu));
-		svdB = svd;
-		svdB.add_identity(std::exp(-beta*B*0.5+beta*mu));
+	// with remake=false the current svd is used instead of multiplying all the slices again
+	std::pair<double, double> make_density_matrices (bool remake = true) {
+		if (remake) make_svd();
+		spin_tasks.run([this] () {
+			svdA = svd;
+			svdA.add_identity(std::exp(+beta*B*0.5+beta*mu));
+		}, [this] () {
+			svdB = svd;
+			svdB.add_identity(std::exp(-beta*B*0.5+beta*mu));
+		});
 		return { svd_probability(), svd_sign() };
 	}
 
-	std::pair<double, double> make_svd_inverse () {
-		std::pair<double, double> ret = make_density_matrices();
-		rho_up = Matrix_d::Identity(V, V) - svdA.inverse();
-		update_matrix_up = rho_up;
-		update_matrix_up.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_up.diagonal() += Vector_d::Ones(V);
-		rho_dn = svdB.inverse();
-		update_matrix_dn = Matrix_d::Identity(V, V) - rho_dn;
-		update_matrix_dn.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_dn.diagonal() += Vector_d::Ones(V);
+	std::pair<double, double> make_svd_inverse (bool remake = true) {
+		std::pair<double, double> ret = make_density_matrices(remake);
+		spin_tasks.run([this] () {
+			rho_up = Matrix_d::Identity(V, V) - svdA.inverse();
+		}, [this] () {
+			rho_dn = svdB.inverse();
+		});
+		make_update_matrices();
 		return ret;
 	}
 
@@ -342,15 +567,10 @@ class Simulation {
 		plainB = plain*std::exp(-beta*B*0.5+beta*mu) + Matrix_d::Identity(V, V);
 		qr.compute(plainA);
 		rho_up = Matrix_d::Identity(V, V) - qr.inverse();
-		update_matrix_up = rho_up;
-		update_matrix_up.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_up.diagonal() += Vector_d::Ones(V);
 		ret.first += qr.logAbsDeterminant();
 		qr.compute(plainB);
 		rho_dn = qr.inverse();
-		update_matrix_dn = Matrix_d::Identity(V, V) - rho_dn;
-		update_matrix_dn.applyOnTheLeft(-2.0*(diagonal(0).array().inverse()+1.0).inverse().matrix().asDiagonal());
-		update_matrix_dn.diagonal() += Vector_d::Ones(V);
+		make_update_matrices();
 		ret.first += qr.logAbsDeterminant();
 		ret.second = (plainA*plainB).determinant()<0.0?-1.0:1.0;
 		return ret;
@@ -365,11 +585,17 @@ class Simulation {
 		return svdA.S.array().log().sum() + svdB.S.array().log().sum();
 	}
 
-	double svd_sign () const {
-		return (svdA.U*svdA.Vt*svdB.U*svdB.Vt).determinant()>0.0?1.0:-1.0;
+	double svd_sign () {
+		return svdA.sign()*svdB.sign();
 	}
 
 	void accumulate_forward (int start, int end, Matrix_d &G_up, Matrix_d &G_dn);
+	void green_function_chain (double s, double h, bool particle_hole,
+			SVDHelper &help, SVDHelper &tmp, Matrix_d &G, Matrix_cd &buffer,
+			std::vector<mymeasurement<Eigen::ArrayXXd>> &out);
+	void add_green_function (mymeasurement<Eigen::ArrayXXd> &m, double s, const Matrix_d &G, Eigen::ArrayXXd &g) const;
+	void reduce_green_function (const Matrix_d &G, Eigen::ArrayXXd &g) const;
+	void prepare_symmetries ();
 
 	void redo_all () {
 		double np, ns;
@@ -389,10 +615,13 @@ class Simulation {
 		reset_updates();
 	}
 
-	void redo_all_svd () {
+	void redo_all_svd (bool remake = true) {
+		PROFILE_SCOPE(profile, Stabilization, 28.0*V*V*V);
 		double np, ns;
-		std::tie(np, ns) = make_svd_inverse();
-		if (fabs(np-plog-update_prob)>1.0e-8 || psign*update_sign!=ns) {
+		std::tie(np, ns) = make_svd_inverse(remake);
+		// single precision blocks are only as good as mixed_precision_threshold
+		const double tolerance = single_precision()?mixed_precision_threshold:1.0e-8;
+		if (fabs(np-plog-update_prob)>tolerance || psign*update_sign!=ns) {
 			std::cerr << "redo " << plog+update_prob << " <> " << np << " ~~ " << np-plog-update_prob << '\t' << (psign*update_sign*ns) << std::endl;
 			plog = np;
 			psign = ns;
@@ -410,15 +639,31 @@ class Simulation {
 	void apply_updates () {
 		for (int i=0;i<update_size;i++) {
 			int x = update_perm[i];
-			diagonal(0)[x] = -diagonal(0)[x];
+			update_flushed[x] ^= 1;
+		}
+		for (int x=0;x<V;x++) {
+			if (update_flushed[x]) diagonal(0)[x] = -diagonal(0)[x];
+			update_flushed[x] = 0;
 		}
 	}
 
+	double schur_complement (const Matrix_d &M, const Matrix_d &Minv, int x, Vector_d &u, Vector_d &w);
+	void swap_update_positions (int i, int j);
+	void accept_update ();
+	void flush_updates ();
 	std::pair<double, double> rank1_probability (int x);
 
 	bool metropolis ();
 
+	// estimated flops of applying one slice to a V x V matrix
+	double propagation_flops () const {
+		if (use_checkerboard) return 6.0*checkerboard.bonds()*V;
+		if (use_fft) return 5.0*V*V*std::log2(double(V));
+		return 2.0*V*V*V;
+	}
+
 	void remove_first_slice (Matrix_d &A) {
+		PROFILE_SCOPE(profile, Propagation, propagation_flops());
 		if (use_fft) {
 			A.applyOnTheRight((Vector_d::Constant(V, 1.0)+diagonal(0)).array().inverse().matrix().asDiagonal());
 			A.transposeInPlace();
@@ -428,11 +673,12 @@ class Simulation {
 			A.transposeInPlace();
 		} else {
 			A.applyOnTheRight((Vector_d::Constant(V, 1.0)+diagonal(0)).array().inverse().matrix().asDiagonal());
-			A.applyOnTheRight(freePropagator_inverse);
+			apply_inverse_propagator_right(A);
 		}
 	}
 
 	void queue_first_slice (Matrix_d &A) {
+		PROFILE_SCOPE(profile, Propagation, propagation_flops());
 		if (use_fft) {
 			A.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(0)).array()).matrix().asDiagonal());
 			fftw_execute_dft_r2c(x2p_col, A.data(), reinterpret_cast<fftw_complex*>(momentumSpace.data()));
@@ -440,11 +686,31 @@ class Simulation {
 			fftw_execute_dft_c2r(p2x_col, reinterpret_cast<fftw_complex*>(momentumSpace.data()), A.data());
 		} else {
 			A.applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(0)).array()).matrix().asDiagonal());
-			A.applyOnTheLeft(freePropagator_matrix);
+			apply_propagator(A);
 		}
 	}
 
-	void set_time_shift (int t) { time_shift = t%N; redo_all(); }
+	// moves the Green functions past the first slice: G -> B G B^-1
+	void wrap_green_functions () {
+		queue_first_slice(rho_up);
+		remove_first_slice(rho_up);
+		queue_first_slice(rho_dn);
+		remove_first_slice(rho_dn);
+	}
+
+	void set_time_shift (int t) { time_shift = t%N; svd_stack_valid = false; redo_all(); }
+
+	void apply_slices (Matrix_d &A, int lo, int hi, Matrix_cd &buffer);
+	void apply_slices (Matrix_d &A, int lo, int hi) { apply_slices(A, lo, hi, momentumSpace); }
+	void remove_slice (Matrix_d &A, int k, Matrix_cd &buffer);
+	bool block_product (int lo, int hi);
+	void make_svd_stack ();
+	// the block of the stack that starts at slice t, -1 if none does
+	int svd_block_start (int t) const {
+		auto i = std::lower_bound(svd_bounds.begin(), svd_bounds.end(), t);
+		return i!=svd_bounds.end() && *i==t ? int(i-svd_bounds.begin()) : -1;
+	}
+	void advance_svd_stack (int b);
 
 	bool shift_time ();
 	bool shift_time_svd ();
@@ -452,7 +718,8 @@ class Simulation {
 	void test_wrap () {
 		std::vector<Matrix_d> v(N);
 		for (int i=0;i<N;i++) {
-			v[i] = freePropagator_matrix;
+			v[i].setIdentity(V, V);
+			apply_propagator(v[i]);
 			v[i].applyOnTheLeft(((Vector_d::Constant(V, 1.0)+diagonal(i)).array()).matrix().asDiagonal());
 			v[i] *= std::exp(-dt*(-mu-0.5*B));
 		}
@@ -462,6 +729,12 @@ class Simulation {
 
 	void load_sigma (lua_State *L, const char *fn);
 
+	// HS fields by absolute time slice, for replica exchange; set_fields
+	// takes only the signs, so that replicas may differ in A
+	const std::vector<Vector_d>& fields () const { return diagonals; }
+	void set_fields (const std::vector<Vector_d> &f);
+	void refresh_fields ();
+
 	double fraction_completed () const {
 		return 1.0;
 	}
@@ -474,47 +747,18 @@ class Simulation {
 		shift_time_svd();
 	}
 
-	void get_green_function (double s = 1.0, int t0 = 0);
+	void get_green_function (double s = 1.0);
 
 	double get_kinetic_energy (const Matrix_d &M) {
 		return (M * hamiltonian).trace();
 	}
 
-	double pair_correlation (const Matrix_d& rho_up, const Matrix_d& rho_dn) {
-		double ret = 0.0;
-		for (int x=0;x<V;x++) {
-			for (int y=0;y<V;y++) {
-				double u = rho_up(x, y);
-				double d = 0.0;
-				d += rho_dn(shift_x(x, +1), shift_x(y, +1));
-				d += rho_dn(shift_x(x, -1), shift_x(y, +1));
-				d -= rho_dn(shift_y(x, +1), shift_x(y, +1));
-				d -= rho_dn(shift_y(x, -1), shift_x(y, +1));
-				d += rho_dn(shift_x(x, +1), shift_x(y, -1));
-				d += rho_dn(shift_x(x, -1), shift_x(y, -1));
-				d -= rho_dn(shift_y(x, +1), shift_x(y, -1));
-				d -= rho_dn(shift_y(x, -1), shift_x(y, -1));
-				d -= rho_dn(shift_x(x, +1), shift_y(y, +1));
-				d -= rho_dn(shift_x(x, -1), shift_y(y, +1));
-				d += rho_dn(shift_y(x, +1), shift_y(y, +1));
-				d += rho_dn(shift_y(x, -1), shift_y(y, +1));
-				d -= rho_dn(shift_x(x, +1), shift_y(y, -1));
-				d -= rho_dn(shift_x(x, -1), shift_y(y, -1));
-				d += rho_dn(shift_y(x, +1), shift_y(y, -1));
-				d += rho_dn(shift_y(x, -1), shift_y(y, -1));
-				ret += u*d;
-			}
-		}
-		return ret / V / V;
-	}
-
-
-
 	void measure ();
 	void measure_quick ();
 	void measure_sign ();
 	int volume () const { return V; }
 	int timeSlices () const { return N; }
+	size_t svd_allocations () const { return svd.allocations + svdA.allocations + svdB.allocations; }
 
 	void write_wavefunction (std::ostream &out);
 
@@ -546,9 +790,11 @@ class Simulation {
 		}
 		out << std::endl;
 		write_green_function();
+		write_correlations();
 	}
 
 	void write_green_function ();
+	void write_correlations ();
 
 	std::string params () {
 		std::ostringstream buf;
@@ -564,6 +810,40 @@ class Simulation {
 	std::pair<double, double> recheck ();
 	void straighten_slices ();
 
+	// pools the measurements of an independent chain with the same parameters
+	void merge_measurements (const Simulation &other) {
+		acceptance.merge(other.acceptance);
+		density.merge(other.density);
+		magnetization.merge(other.magnetization);
+		singlet.merge(other.singlet);
+		order_parameter.merge(other.order_parameter);
+		chi_d.merge(other.chi_d);
+		chi_af.merge(other.chi_af);
+		kinetic.merge(other.kinetic);
+		interaction.merge(other.interaction);
+		sign.merge(other.sign);
+		measured_sign.merge(other.measured_sign);
+		exact_sign.merge(other.exact_sign);
+		for (int i=0;i<V;i++) {
+			d_up[i].merge(other.d_up[i]);
+			d_dn[i].merge(other.d_dn[i]);
+			spincorrelation[i].merge(other.spincorrelation[i]);
+		}
+		spin_r.merge(other.spin_r);
+		density_r.merge(other.density_r);
+		pair_r.merge(other.pair_r);
+		spin_q.merge(other.spin_q);
+		density_q.merge(other.density_q);
+		pair_q.merge(other.pair_q);
+		for (size_t t=0;t<error.size();t++) {
+			error[t].merge(other.error[t]);
+			green_function_up[t].merge(other.green_function_up[t]);
+			green_function_dn[t].merge(other.green_function_dn[t]);
+		}
+		steps += other.steps;
+		profile.merge(other.profile);
+	}
+
 	void discard_measurements () {
 		acceptance.clear();
 		density.clear();
@@ -582,6 +862,12 @@ class Simulation {
 			d_dn[i].clear();
 			spincorrelation[i].clear();
 		}
+		spin_r.clear();
+		density_r.clear();
+		pair_r.clear();
+		spin_q.clear();
+		density_q.clear();
+		pair_q.clear();
 	}
 
 	protected:
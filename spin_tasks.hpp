@@ -0,0 +1,111 @@
+#ifndef SPIN_TASKS_HPP
+#define SPIN_TASKS_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include "profiler.hpp"
+
+// runs the spin-up and spin-down chains of one simulation side by side:
+// the down chain goes to a single persistent worker while the calling thread
+// does the up chain. The two tasks must write disjoint data, so the results
+// do not depend on the scheduling. When disabled everything runs in order on
+// the calling thread.
+class SpinTasks {
+	bool enabled;
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::function<void()> task;
+	std::exception_ptr error;
+	bool pending;
+	bool quit;
+	PhaseProfile *profile; // time the calling thread waits for the down chain
+
+	void loop () {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			cond.wait(guard, [this] () { return pending || quit; });
+			if (quit) return;
+			guard.unlock();
+			try {
+				task();
+			} catch (...) {
+				error = std::current_exception();
+			}
+			guard.lock();
+			pending = false;
+			cond.notify_all();
+		}
+	}
+
+	static PhaseProfile& unused_profile () {
+		static PhaseProfile p;
+		return p;
+	}
+
+	void stop () {
+		if (!worker.joinable()) return;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		cond.notify_all();
+		worker.join();
+	}
+
+	public:
+
+	void setEnabled (bool e) {
+		enabled = e;
+		if (enabled && !worker.joinable()) {
+			quit = false;
+			worker = std::thread(&SpinTasks::loop, this);
+		} else if (!enabled) {
+			stop();
+		}
+	}
+
+	bool isEnabled () const { return enabled; }
+
+	// profile must outlive the tasks; it is only used with -DPROFILE_PHASES
+	void setProfile (PhaseProfile *p) { profile = p; }
+
+	void run (const std::function<void()> &up, const std::function<void()> &dn) {
+		if (!enabled) {
+			up();
+			dn();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			task = dn;
+			error = nullptr;
+			pending = true;
+		}
+		cond.notify_all();
+		std::exception_ptr up_error;
+		try {
+			up();
+		} catch (...) {
+			up_error = std::current_exception();
+		}
+		{
+			PROFILE_SCOPE(*profile, SpinWait, 0.0);
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [this] () { return !pending; });
+		}
+		if (up_error) std::rethrow_exception(up_error);
+		if (error) std::rethrow_exception(error);
+	}
+
+	SpinTasks () : enabled(false), pending(false), quit(false), profile(&unused_profile()) {}
+	SpinTasks (const SpinTasks &) = delete;
+	SpinTasks& operator= (const SpinTasks &) = delete;
+	~SpinTasks () { stop(); }
+};
+
+#endif // SPIN_TASKS_HPP
@@ -1,10 +1,13 @@
 #ifndef SVD_HPP
 #define SVD_HPP
 
+#include <Eigen/LU>
 #include <Eigen/QR>
 #include <Eigen/SVD>
 
 #include <iostream>
+#include <string>
+#include <algorithm>
 
 #if !defined EIGEN_USE_MKL_ALL
 extern "C" void dgesvd_ (const char *jobu, const char *jobvt,
@@ -15,6 +18,23 @@ extern "C" void dgesvd_ (const char *jobu, const char *jobvt,
 		double *VT, const int &ldvt,
 		double *work, const int &lwork, int &info);
 
+extern "C" void dgesdd_ (const char *jobz,
+		const int &M, const int &N,
+		double *A, const int &lda,
+		double *S,
+		double *U, const int &ldu,
+		double *VT, const int &ldvt,
+		double *work, const int &lwork,
+		int *iwork, int &info);
+
+extern "C" void dgesvj_ (const char *joba, const char *jobu, const char *jobv,
+		const int &M, const int &N,
+		double *A, const int &lda,
+		double *SVA,
+		const int &MV,
+		double *V, const int &ldv,
+		double *work, const int &lwork, int &info);
+
 extern "C" void dggev_ (const char *jobvl, const char *jobvr,
 		const int &N,
 		double *A, const int &lda,
@@ -26,8 +46,23 @@ extern "C" void dggev_ (const char *jobvl, const char *jobvr,
 		double *VR, const int &ldvr,
 		double *work, const int &lwork, int &info);
 
+extern "C" void dgeqp3_ (const int &M, const int &N,
+		double *A, const int &lda,
+		int *jpvt,
+		double *tau,
+		double *work, const int &lwork, int &info);
+
+extern "C" void dorgqr_ (const int &M, const int &N, const int &K,
+		double *A, const int &lda,
+		double *tau,
+		double *work, const int &lwork, int &info);
+
 #define mydgesvd dgesvd_
+#define mydgesdd dgesdd_
+#define mydgesvj dgesvj_
 #define mydggev dggev_
+#define mydgeqp3 dgeqp3_
+#define mydorgqr dorgqr_
 
 #else
 
@@ -41,6 +76,27 @@ inline void mydgesvd (const char *jobu, const char *jobvt,
 	dgesvd_(jobu, jobvt, &M, &N, A, &lda, S, U, &ldu, VT, &ldvt, work, &lwork, &info);
 }
 
+inline void mydgesdd (const char *jobz,
+		const int &M, const int &N,
+		double *A, const int &lda,
+		double *S,
+		double *U, const int &ldu,
+		double *VT, const int &ldvt,
+		double *work, const int &lwork,
+		int *iwork, int &info) {
+	dgesdd_(jobz, &M, &N, A, &lda, S, U, &ldu, VT, &ldvt, work, &lwork, iwork, &info);
+}
+
+inline void mydgesvj (const char *joba, const char *jobu, const char *jobv,
+		const int &M, const int &N,
+		double *A, const int &lda,
+		double *SVA,
+		const int &MV,
+		double *V, const int &ldv,
+		double *work, const int &lwork, int &info) {
+	dgesvj_(joba, jobu, jobv, &M, &N, A, &lda, SVA, &MV, V, &ldv, work, &lwork, &info);
+}
+
 inline void mydggev (const char *jobvl, const char *jobvr,
 		const int &N,
 		double *A, const int &lda,
@@ -54,20 +110,107 @@ inline void mydggev (const char *jobvl, const char *jobvr,
 	dggev_(jobvl, jobvr, &N, A, &lda, B, &ldb, alphar, alphai, beta, VL, &ldvl, VR, &ldvr, work, &lwork, &info);
 }
 
+inline void mydgeqp3 (const int &M, const int &N,
+		double *A, const int &lda,
+		int *jpvt,
+		double *tau,
+		double *work, const int &lwork, int &info) {
+	dgeqp3_(&M, &N, A, &lda, jpvt, tau, work, &lwork, &info);
+}
+
+inline void mydorgqr (const int &M, const int &N, const int &K,
+		double *A, const int &lda,
+		double *tau,
+		double *work, const int &lwork, int &info) {
+	dorgqr_(&M, &N, &K, A, &lda, tau, work, &lwork, &info);
+}
+
+#endif
+
+// Default decomposition used by SVDHelper. Building with -DSVD_USE_UDT
+// replaces dgesvd by a column-pivoted QR (UDT) everywhere; single
+// simulations can still select it at runtime with setMethod().
+#if defined SVD_USE_UDT
+#define SVD_DEFAULT_METHOD SVDHelper::UDT
+#else
+#define SVD_DEFAULT_METHOD SVDHelper::SVD
 #endif
 
 struct SVDHelper {
 	typedef Eigen::VectorXd Vector;
 	typedef Eigen::MatrixXd Matrix;
 	typedef Eigen::ArrayXd Array;
+
+	// SVD: U and Vt are both orthogonal (dgesvd)
+	// UDT: U is orthogonal, Vt is a well-conditioned matrix T obtained from
+	//      a column-pivoted QR (dgeqp3); S keeps the scales |diag(R)|
+	// In both cases the decomposed matrix is U*S*Vt, so logdet and sign can
+	// be read in the same way. For the products of slices we use both agree
+	// to ~1e-10 in the logdet and exactly in the sign.
+	enum Method { SVD, UDT };
+
+	// LAPACK driver used by the SVD method in absorbU, add_identity,
+	// add_svd and rank1_update: QR iteration, divide and conquer, or
+	// one-sided Jacobi (slowest, but most accurate on graded matrices)
+	enum Driver { GESVD, GESDD, GESVJ };
+
 	Array work;
 	Matrix U;
 	Vector S;
 	Matrix Vt;
 	Matrix other;
 
+	// workspace: the scratch buffers below keep their shape between calls,
+	// so that once the sizes are settled none of the updates touches the
+	// heap. allocations counts every time one of them had to be resized.
 	Matrix A;
 	Matrix B;
+	Matrix C;
+	Vector x;
+	Vector y;
+	Eigen::VectorXi jpvt;
+	Eigen::VectorXi iwork;
+	Vector tau;
+	Eigen::PartialPivLU<Matrix> lu;
+	size_t allocations;
+
+	// signs of det(U) and det(Vt), 0.0 when not known yet: the UDT method
+	// reads them off the reflectors and pivots, the SVD drivers leave them
+	// to a LU of the factor on request. left_sign and right_sign hold the
+	// same for the two factors of the last decomposition.
+	double signU;
+	double signVt;
+	double left_sign;
+	double right_sign;
+
+	Method method;
+	Driver driver;
+
+	SVDHelper () : allocations(0), signU(0.0), signVt(0.0), left_sign(0.0), right_sign(0.0), method(SVD_DEFAULT_METHOD), driver(GESVD) {}
+
+	template <typename T>
+	T& scratch (T &M, int rows, int cols = 1) {
+		if (M.size()!=rows*cols) allocations++;
+		M.resize(rows, cols);
+		return M;
+	}
+
+	void setMethod (Method m) { method = m; }
+	void setDriver (Driver d) { driver = d; }
+
+	static const char *driverName (Driver d) {
+		switch (d) {
+			case GESDD: return "gesdd";
+			case GESVJ: return "gesvj";
+			default: return "gesvd";
+		}
+	}
+
+	static Driver driverFromName (const std::string &s) {
+		if (s=="gesdd") return GESDD;
+		if (s=="gesvj") return GESVJ;
+		return GESVD;
+	}
 
 	void setSize (int outer, int inner) {
 		U.resize(outer, inner);
@@ -75,16 +218,39 @@ struct SVDHelper {
 		Vt.resize(inner, outer);
 		other.resize(inner, inner);
 		work.resize(5*inner+outer);
+		resetSigns();
 	}
 
 	void setIdentity (int N) {
 		U.setIdentity(N, N);
 		S.setOnes(N);
 		Vt.setIdentity(N, N);
+		signU = signVt = 1.0;
+	}
+
+	// to be called after assigning U or Vt directly
+	void resetSigns () {
+		signU = signVt = 0.0;
+	}
+
+	double factor_sign (const Matrix &X) {
+		if (X.rows()!=X.cols()) return 1.0;
+		lu.compute(X);
+		return lu.determinant()<0.0?-1.0:1.0;
+	}
+
+	// sign of det(U*Vt), i.e. of the decomposed matrix
+	double sign () {
+		if (signU==0.0) signU = factor_sign(U);
+		if (signVt==0.0) signVt = factor_sign(Vt);
+		return signU*signVt;
 	}
 
 	void reserve (int N) {
-		if (work.size()<N) work.resize(N);
+		if (work.size()<N) {
+			work.resize(N);
+			allocations++;
+		}
 	}
 
 	void check_info (int info) {
@@ -98,6 +264,80 @@ struct SVDHelper {
 		}
 	}
 
+	// column pivoted QR of M: on exit M holds Q (thin), D the moduli of the
+	// diagonal of R and T = D^-1 R P^T, so that M(before) = Q * D * T
+	void udt (Matrix &M, Vector &D, Matrix &T) {
+		const int m = M.rows();
+		const int n = M.cols();
+		const int k = m<n?m:n;
+		int info = 0;
+		scratch(jpvt, n).setZero();
+		scratch(tau, k);
+		reserve(3*n+1);
+		mydgeqp3(m, n, M.data(), m, jpvt.data(), tau.data(), work.data(), work.size(), info);
+		check_info(info);
+		D = M.topLeftCorner(k, k).diagonal().cwiseAbs();
+		scratch(T, k, n).setZero();
+		for (int j=0;j<n;j++) {
+			for (int i=0;i<=j && i<k;i++) {
+				T(i, jpvt[j]-1) = D[i]>0.0?M(i, j)/D[i]:M(i, j);
+			}
+		}
+		// det(Q) is -1 for every non-trivial reflector, det(T) is the
+		// product of the signs of diag(R) times the parity of the pivots
+		left_sign = right_sign = 1.0;
+		for (int i=0;i<k;i++) {
+			if (tau[i]!=0.0) left_sign = -left_sign;
+			if (M(i, i)<0.0) right_sign = -right_sign;
+		}
+		for (int j=0;j<n;j++) {
+			int l = 0;
+			for (int i=j;jpvt[i]>0;i=-jpvt[i]-1,l++) jpvt[i] = -jpvt[i];
+			if (l>0 && l%2==0) right_sign = -right_sign;
+		}
+		if (m!=k) left_sign = 1.0;
+		if (n!=k) right_sign = 1.0;
+		reserve(k);
+		mydorgqr(m, k, k, M.data(), m, tau.data(), work.data(), work.size(), info);
+		check_info(info);
+		if (k<n) M.conservativeResize(m, k);
+	}
+
+	// SVD of M (rows>=cols) with the selected driver: on exit M holds U,
+	// S the singular values and W the right factor, so that M(before) = U * S * W
+	void svdInPlace (Matrix &M, Matrix &W) {
+		const int m = M.rows();
+		const int n = M.cols();
+		int info = 0;
+		scratch(S, n);
+		scratch(W, n, n);
+		left_sign = right_sign = 0.0;
+		switch (driver) {
+			case GESDD:
+				reserve(3*n+std::max(m, 5*n*n+4*n));
+				scratch(iwork, 8*n);
+				mydgesdd("O", m, n, M.data(), m, S.data(), NULL, 1, W.data(), n, work.data(), work.size(), iwork.data(), info);
+				check_info(info);
+				break;
+			case GESVJ:
+				// returns V instead of V^T and the singular values scaled by work[0]
+				reserve(std::max(6, m+n));
+				mydgesvj("G", "U", "V", m, n, M.data(), m, S.data(), 0, scratch(C, n, n).data(), n, work.data(), work.size(), info);
+				if (info<0) {
+					std::cerr << "mydgesvj: error at argument " << -info << std::endl;
+				} else if (info>0) {
+					std::cerr << "DGESVJ did not converge in " << info << " sweeps" << std::endl;
+				}
+				S *= work[0];
+				W = C.transpose();
+				break;
+			default:
+				reserve(5*n+m);
+				mydgesvd("O", "S", m, n, M.data(), m, S.data(), M.data(), m, W.data(), n, work.data(), work.size(), info);
+				check_info(info);
+		}
+	}
+
 	// this leaves a state that is inconsistent with the rest of the class since one of V and U cannot be multiplied by S
 	void fullSVD (const Matrix &A) {
 		const int M = A.rows();
@@ -109,6 +349,7 @@ struct SVDHelper {
 		U.resize(M, M);
 		S.resize(inner);
 		Vt.resize(N, N);
+		resetSigns();
 		reserve(5*inner+outer);
 		mydgesvd("A", "A", M, N, B.data(), M, S.data(), U.data(), M, Vt.data(), N, work.data(), work.size(), info);
 		check_info(info);
@@ -124,6 +365,7 @@ struct SVDHelper {
 		U.resize(M, inner);
 		S.resize(inner);
 		Vt.resize(inner, N);
+		resetSigns();
 		reserve(5*inner+outer);
 		mydgesvd("S", "S", M, N, B.data(), M, S.data(), U.data(), M, Vt.data(), inner, work.data(), work.size(), info);
 		check_info(info);
@@ -133,14 +375,18 @@ struct SVDHelper {
 		const int M = A.rows();
 		const int N = A.cols();
 		int info = 0;
+		if (method==UDT) {
+			U = A;
+			udt(U, S, Vt);
+			signU = left_sign;
+			signVt = right_sign;
+			return;
+		}
+		resetSigns();
 		if (M>N) {
-			const int inner = M<N?M:N;
-			const int outer = M<N?N:M;
 			U = A;
-			S.resize(inner);
-			Vt.resize(inner, N);
-			reserve(5*inner+outer);
-			mydgesvd("O", "S", M, N, U.data(), M, S.data(), U.data(), M, Vt.data(), inner, work.data(), work.size(), info);
+			svdInPlace(U, Vt);
+			return;
 		} else {
 			const int inner = M<N?M:N;
 			const int outer = M<N?N:M;
@@ -155,17 +401,16 @@ struct SVDHelper {
 
 	// this will only work if M>=N
 	void absorbU () {
-		const int M = U.rows();
-		const int N = U.cols();
-		int info = 0;
 		U.applyOnTheRight(S.asDiagonal());
-		const int inner = M<N?M:N;
-		const int outer = M<N?N:M;
-		other.resize(inner, inner);
-		reserve(5*inner+outer);
-		mydgesvd("O", "S", M, N, U.data(), M, S.data(), U.data(), M, other.data(), inner, work.data(), work.size(), info);
-		check_info(info);
-		Vt.applyOnTheLeft(other);
+		if (method==UDT) {
+			udt(U, S, other);
+		} else {
+			svdInPlace(U, other);
+		}
+		signU = left_sign;
+		signVt *= right_sign;
+		scratch(A, other.rows(), Vt.cols()).noalias() = other * Vt;
+		Vt.swap(A);
 	}
 
 	// this will only work if M<=N
@@ -174,15 +419,26 @@ struct SVDHelper {
 		const int N = Vt.cols();
 		int info = 0;
 		Vt.applyOnTheLeft(S.asDiagonal());
+		if (method==UDT) {
+			udt(Vt, S, other);
+			signU *= left_sign;
+			signVt = right_sign;
+			scratch(A, U.rows(), Vt.cols()).noalias() = U * Vt;
+			U.swap(A);
+			Vt.swap(other);
+			return;
+		}
+		resetSigns();
 		const int inner = M<N?M:N;
 		const int outer = M<N?N:M;
 		S.resize(inner);
-		other.resize(inner, inner);
+		scratch(other, inner, inner);
 		reserve(5*inner+outer);
 		if (M<=N) {
 			mydgesvd("S", "O", M, N, Vt.data(), M, S.data(), other.data(), M, Vt.data(), inner, work.data(), work.size(), info);
 			check_info(info);
-			U.applyOnTheRight(other);
+			scratch(A, U.rows(), other.cols()).noalias() = U * other;
+			U.swap(A);
 		} else {
 			mydgesvd("O", "S", M, N, Vt.data(), M, S.data(), Vt.data(), M, other.data(), inner, work.data(), work.size(), info);
 			check_info(info);
@@ -191,47 +447,79 @@ struct SVDHelper {
 		}
 	}
 
+	// T^-1 is T^T only for the SVD, in the UDT case it has to be solved for
+	// stores (T^-1)^T * X in R
+	template <typename X, typename R>
+	void rightSolve (const Matrix &T, Method m, const X &x, R &r) {
+		if (m==UDT) {
+			lu.compute(T.transpose());
+			r.noalias() = lu.solve(x);
+		} else {
+			r.noalias() = T * x;
+		}
+	}
+
+	// decompose other in place and multiply the factors into A (left) and B (right),
+	// sA and sB being the signs of their determinants
+	void decomposeOther (double sA, double sB) {
+		if (method==UDT) {
+			udt(other, S, Vt);
+		} else {
+			svdInPlace(other, Vt);
+		}
+		signU = sA*left_sign;
+		signVt = right_sign*sB;
+		scratch(U, A.rows(), other.cols()).noalias() = A * other;
+		scratch(other, Vt.rows(), B.cols()).noalias() = Vt * B;
+		Vt.swap(other);
+	}
+
 	// TODO size constraints!
 	void rank1_update (const Vector &u, const Vector &v, double lambda = 1.0) {
 		const int N = S.size();
-		int info = 0;
-		Matrix A = U;
-		Matrix B = Vt;
-		other = lambda * (U.transpose()*u) * (v.transpose() * Vt.transpose());
+		scratch(A, U.rows(), U.cols()) = U;
+		scratch(B, Vt.rows(), Vt.cols()) = Vt;
+		scratch(x, N).noalias() = U.transpose() * u;
+		rightSolve(Vt, method, v, scratch(y, N));
+		scratch(other, N, N).noalias() = lambda * x * y.transpose();
 		other.diagonal() += S;
-		mydgesvd("A", "A", N, N, other.data(), N, S.data(), U.data(), N, Vt.data(), N, work.data(), work.size(), info);
-		check_info(info);
-		U.applyOnTheLeft(A);
-		Vt.applyOnTheRight(B);
+		decomposeOther(signU, signVt);
 	}
 
 	// TODO size constraints!
 	void add_identity (double lambda = 1.0) {
 		const int N = S.size();
-		int info = 0;
-		A = U; // FIXME: allocation -> is this cache friendly?
-		B = Vt; // FIXME: allocation -> is this cache friendly?
-		other = U.transpose() * Vt.transpose();
+		scratch(A, U.rows(), U.cols()) = U;
+		scratch(B, Vt.rows(), Vt.cols()) = Vt;
+		rightSolve(Vt, method, U, scratch(C, N, N));
+		scratch(other, N, N) = C.transpose();
 		other.diagonal() += S * lambda;
-		reserve(6*N);
-		mydgesvd("A", "A", N, N, other.data(), N, S.data(), U.data(), N, Vt.data(), N, work.data(), work.size(), info);
-		check_info(info);
-		U.applyOnTheLeft(A);
-		Vt.applyOnTheRight(B);
+		decomposeOther(signU, signVt);
 	}
 
 	// TODO size constraints!
 	void add_svd (const SVDHelper &s) {
 		const int N = S.size();
-		int info = 0;
-		Matrix A = U;
-		Matrix B = s.Vt;
-		other = (U.transpose()*s.U) * s.S.asDiagonal();
-		other += S.asDiagonal() * (Vt*s.Vt.transpose());
-		mydgesvd("A", "A", N, N, other.data(), N, S.data(), U.data(), N, Vt.data(), N, work.data(), work.size(), info);
-		check_info(info);
-		U.applyOnTheLeft(A);
-		Vt.applyOnTheRight(B);
+		scratch(A, U.rows(), U.cols()) = U;
+		scratch(B, s.Vt.rows(), s.Vt.cols()) = s.Vt;
+		scratch(other, N, N).noalias() = U.transpose() * s.U;
+		other.applyOnTheRight(s.S.asDiagonal());
+		rightSolve(s.Vt, s.method, Vt.transpose(), scratch(C, N, N));
+		other.noalias() += S.asDiagonal() * C.transpose();
+		decomposeOther(signU, s.signVt);
+	}
+
+	// decomposition of the product a*b: a.U (a.S a.Vt b.U b.S) b.Vt
+	void product (const SVDHelper &a, const SVDHelper &b) {
+		scratch(U, a.Vt.rows(), b.U.cols()).noalias() = a.Vt * b.U;
+		U.applyOnTheLeft(a.S.asDiagonal());
+		S = b.S;
+		Vt = b.Vt;
+		signVt = b.signVt;
+		absorbU();
+		scratch(A, a.U.rows(), U.cols()).noalias() = a.U * U;
+		U.swap(A);
+		signU *= a.signU;
 	}
 
 	Matrix matrix () const {
@@ -239,15 +527,38 @@ struct SVDHelper {
 	}
 
 	Matrix inverse () const {
+		if (method==UDT) {
+			return Vt.partialPivLu().solve(S.array().inverse().matrix().asDiagonal() * U.transpose());
+		}
 		return Vt.transpose() * S.array().inverse().matrix().asDiagonal() * U.transpose();
 	}
 
 	void invertInPlace () {
+		if (method==UDT) {
+			// (QDT)^-1 = T^-1 D^-1 Q^T, decompose again to keep U orthogonal
+			lu.compute(Vt);
+			scratch(C, S.size(), S.size()).setZero();
+			C.diagonal() = S.cwiseInverse();
+			scratch(other, Vt.rows(), Vt.cols()).noalias() = lu.solve(C);
+			scratch(B, U.cols(), U.rows()) = U.transpose();
+			udt(other, S, Vt);
+			signVt = right_sign*signU;
+			signU = left_sign;
+			U.swap(other);
+			scratch(other, Vt.rows(), B.cols()).noalias() = Vt * B;
+			Vt.swap(other);
+			return;
+		}
 		S = S.array().inverse().matrix();
 		S.reverseInPlace();
 		other = U.transpose().colwise().reverse();
 		U = Vt.transpose().rowwise().reverse();
 		Vt = other;
+		// reversing the order of N rows or columns has parity (-1)^(N(N-1)/2)
+		const double r = (S.size()*(S.size()-1)/2)%2?-1.0:1.0;
+		std::swap(signU, signVt);
+		signU *= r;
+		signVt *= r;
 		//other.setZero(S.size(), S.size());
 		//for (int i=0;i<S.size();i++) {
 			//other(i, S.size()-i-1) = 1.0;
@@ -292,7 +603,11 @@ struct SVDHelper {
 		U = svd.U;
 		S = svd.S;
 		Vt = svd.Vt;
-		other.resize(svd.other.rows(), svd.other.cols());
+		signU = svd.signU;
+		signVt = svd.signVt;
+		method = svd.method;
+		driver = svd.driver;
+		scratch(other, svd.other.rows(), svd.other.cols());
 		return *this;
 	}
 };
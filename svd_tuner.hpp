@@ -0,0 +1,115 @@
+#ifndef SVD_TUNER_HPP
+#define SVD_TUNER_HPP
+
+#include "accumulator.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <mutex>
+
+#include <Eigen/QR>
+
+// identifies the binary the timings were taken with
+#if defined EIGEN_USE_MKL_ALL
+#define SVD_TUNER_BUILD "mkl-" __DATE__ "-" __TIME__
+#else
+#define SVD_TUNER_BUILD "lapack-" __DATE__ "-" __TIME__
+#endif
+
+class SVDTuner {
+	std::string cache_file;
+	double prec;
+	int slices;
+	int msvd;
+	double spread;
+
+	typedef std::chrono::steady_clock clock;
+	typedef std::chrono::duration<double> seconds_type;
+
+	static std::mutex& file_lock () {
+		static std::mutex lock;
+		return lock;
+	}
+
+	static std::string build () {
+		std::string ret = SVD_TUNER_BUILD;
+		for (char &c : ret) if (c==' ') c = '_';
+		return ret;
+	}
+
+	bool lookup (int V, SVDHelper::Driver &d) const {
+		std::lock_guard<std::mutex> guard(file_lock());
+		std::ifstream in(cache_file);
+		std::string b, name;
+		int v;
+		while (in >> b >> v >> name) {
+			if (b==build() && v==V) {
+				d = SVDHelper::driverFromName(name);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void store (int V, SVDHelper::Driver d) const {
+		std::lock_guard<std::mutex> guard(file_lock());
+		std::ofstream out(cache_file, std::ios::app);
+		out << build() << ' ' << V << ' ' << SVDHelper::driverName(d) << std::endl;
+	}
+
+	public:
+
+	// accumulates a product of random slices with known determinant, the
+	// same way V3Probability::accumulate does, and returns the elapsed time
+	// or a negative value if the logdet check fails
+	double time_driver (int V, SVDHelper::Driver d) const {
+		Eigen::MatrixXd Q = Eigen::MatrixXd::Random(V, V).householderQr().householderQ();
+		Eigen::ArrayXd r;
+		Accumulator acc;
+		acc.SVD().setMethod(SVDHelper::SVD);
+		acc.SVD().setDriver(d);
+		acc.reset(V);
+		acc.decomposeU();
+		clock::time_point t0 = clock::now();
+		for (int i=0;i<slices;i++) {
+			r = spread*Eigen::ArrayXd::Random(V);
+			acc.matrixU().applyOnTheLeft(Q);
+			acc.matrixU().array().colwise() *= r.exp();
+			acc.increase_logdet(r.sum());
+			if ((i+1)%msvd==0) acc.decomposeU();
+		}
+		acc.decomposeU();
+		double ret = std::chrono::duration_cast<seconds_type>(clock::now()-t0).count();
+		return acc.testLogDet(prec)?ret:-1.0;
+	}
+
+	// fastest driver that passes the logdet check for matrices of size V;
+	// the result is cached on disk so that later jobs skip the timings
+	SVDHelper::Driver tune (int V) const {
+		SVDHelper::Driver ret = SVDHelper::GESVD;
+		if (lookup(V, ret)) return ret;
+		double best = -1.0;
+		for (SVDHelper::Driver d : { SVDHelper::GESVD, SVDHelper::GESDD, SVDHelper::GESVJ }) {
+			double t = time_driver(V, d);
+			std::cerr << "SVD tuning: " << SVDHelper::driverName(d) << " takes " << t << "s at V=" << V << std::endl;
+			if (t>=0.0 && (best<0.0 || t<best)) {
+				best = t;
+				ret = d;
+			}
+		}
+		std::cerr << "SVD tuning: using " << SVDHelper::driverName(ret) << " at V=" << V << std::endl;
+		store(V, ret);
+		return ret;
+	}
+
+	void setPrecision (double p) { prec = p; }
+	void setSlices (int n, int m) { slices = n; msvd = m>0?m:1; }
+	// log-range of a single slice: larger values grade the product harder
+	void setSpread (double s) { spread = s; }
+
+	SVDTuner (const std::string &fn = "svd_tuning.dat") : cache_file(fn), prec(1.0e-6), slices(40), msvd(4), spread(2.0) {}
+};
+
+#endif // SVD_TUNER_HPP
@@ -0,0 +1,54 @@
+#include "checkerboard.hpp"
+
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// the checkerboard propagator of a square lattice with a trap is exp(-dt H)
+// up to a Trotter error of order dt^3, its inverse is exact, and applying it
+// on the right agrees with the matrix
+
+const int L = 6;
+
+int main () {
+	const int V = L*L;
+	Matrix_d H = Matrix_d::Zero(V, V);
+	for (int x=0;x<L;x++) {
+		for (int y=0;y<L;y++) {
+			int a = x*L+y;
+			int b = ((x+1)%L)*L+y;
+			int c = x*L+(y+1)%L;
+			H(a, b) = H(b, a) = -1.0;
+			H(a, c) = H(c, a) = -1.0;
+			H(a, a) = 0.05*(x-0.5*L+0.5)*(x-0.5*L+0.5);
+		}
+	}
+	SelfAdjointEigenSolver<Matrix_d> es(H);
+	const Matrix_d I = Matrix_d::Identity(V, V);
+	double error[2];
+	for (int k=0;k<2;k++) {
+		const double dt = k==0?0.1:0.05;
+		const Matrix_d P = es.eigenvectors() * (-dt*es.eigenvalues().array()).exp().matrix().asDiagonal() * es.eigenvectors().transpose();
+		Checkerboard cb;
+		cb.build(H, dt);
+		const Matrix_d C = cb.matrix();
+		const Matrix_d C_inverse = cb.matrix(true);
+		error[k] = (C-P).norm()/P.norm();
+		if (error[k]>1.0e-2*dt) return 1;
+		if (!(C-C.transpose()).isZero(1.0e-12)) return 1;
+		if (!(C_inverse*C).isApprox(I, 1.0e-12)) return 1;
+		if (!(C*C_inverse).isApprox(I, 1.0e-12)) return 1;
+		Matrix_d A = Matrix_d::Random(V, V);
+		Matrix_d B = A;
+		cb.applyRight(B);
+		if (!B.isApprox(A*C, 1.0e-12)) return 1;
+		B = A;
+		cb.applyRight(B, true);
+		if (!B.isApprox(A*C_inverse, 1.0e-12)) return 1;
+	}
+	// half the step, an eighth of the error
+	if (error[0]<6.0*error[1]) return 1;
+	return 0;
+}
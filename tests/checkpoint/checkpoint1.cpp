@@ -0,0 +1,78 @@
+#include "simulation.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+// a Simulation resumed from a binary checkpoint has the fields, weight and
+// Green functions of the one that saved it, and continues the same chain;
+// damaged and text files are reported as such
+
+const char *fn = "checkpoint1.ckpt";
+
+const char *settings = "return {"
+	" Lx = 4, Ly = 4, Lz = 1, N = 20, beta = 2.0, tx = 1.0, ty = 1.0, tz = 1.0,"
+	" U = 4.0, mu = 0.5, B = 0.0, SEED = %d, OUTPUT = '', gf_file = '',"
+	" SLICES = 1, SVD = 5, flips_per_update = 16, use_fft = false,"
+	" decomposition = 'svd', svd_driver = 'gesvd', max_update_size = 4,"
+	" }";
+
+Simulation* make_simulation (lua_State *L, int seed) {
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), settings, seed);
+	if (luaL_dostring(L, buffer)) return nullptr;
+	Simulation *ret = new Simulation(L, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+bool close (double a, double b) {
+	return std::fabs(a-b)<=1.0e-8*std::max(1.0, std::fabs(a));
+}
+
+int main () {
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	Simulation *a = make_simulation(L, 1);
+	Simulation *b = make_simulation(L, 2);
+	if (a==nullptr || b==nullptr) return 1;
+	// stop inside a block of SVD slices
+	for (int i=0;i<27;i++) a->update();
+	if (!a->save_checkpoint(fn, 3, 7, "job")) return 1;
+
+	int thermalization = 0, sweeps = 0;
+	if (b->load_checkpoint(fn, thermalization, sweeps)!=CheckpointLoaded) return 1;
+	if (thermalization!=3 || sweeps!=7) return 1;
+	for (int t=0;t<a->timeSlices();t++) {
+		if (a->fields()[t]!=b->fields()[t]) return 1;
+	}
+	if (!close(a->plog, b->plog) || a->psign!=b->psign) return 1;
+	if (!a->rho_up.isApprox(b->rho_up, 1.0e-8)) return 1;
+	if (!a->rho_dn.isApprox(b->rho_dn, 1.0e-8)) return 1;
+	for (int i=0;i<10;i++) {
+		a->update();
+		b->update();
+	}
+	for (int t=0;t<a->timeSlices();t++) {
+		if (a->fields()[t]!=b->fields()[t]) return 1;
+	}
+
+	// half a checkpoint is damaged and leaves the simulation alone
+	std::ifstream src(fn, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+	std::ofstream(fn, std::ios::binary).write(data.data(), data.size()/2);
+	if (b->load_checkpoint(fn, thermalization, sweeps)!=CheckpointDamaged) return 1;
+	for (int t=0;t<a->timeSlices();t++) {
+		if (a->fields()[t]!=b->fields()[t]) return 1;
+	}
+
+	std::ofstream(fn) << "return { N = 20 }\n";
+	if (b->load_checkpoint(fn, thermalization, sweeps)!=CheckpointNotBinary) return 1;
+	std::remove(fn);
+	delete a;
+	delete b;
+	lua_close(L);
+	return 0;
+}
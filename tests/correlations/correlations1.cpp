@@ -0,0 +1,99 @@
+#include "correlations.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// CorrelationFunctions gives the same spin correlation along x and d-wave
+// pair susceptibility as the site loops it replaced in Simulation::measure,
+// the density correlation of the same loops at every distance, and S(0) as
+// the sum over distances
+
+const int Lx = 6;
+const int Ly = 4;
+const int Lz = 1;
+const int V = Lx*Ly*Lz;
+
+int shift_x (int x, int k) {
+	int a = (x/Ly/Lz)%Lx;
+	int b = x%(Ly*Lz);
+	return ((a+k+Lx)%Lx)*Ly*Lz + b;
+}
+
+int shift_y (int y, int k) {
+	int a = (y/Lz)%Ly;
+	int b = y-a*Lz;
+	return ((a+k+Ly)%Ly)*Lz + b;
+}
+
+double pair_correlation (const Matrix_d& rho_up, const Matrix_d& rho_dn) {
+	double ret = 0.0;
+	for (int x=0;x<V;x++) {
+		for (int y=0;y<V;y++) {
+			double u = rho_up(x, y);
+			double d = 0.0;
+			d += rho_dn(shift_x(x, +1), shift_x(y, +1));
+			d += rho_dn(shift_x(x, -1), shift_x(y, +1));
+			d -= rho_dn(shift_y(x, +1), shift_x(y, +1));
+			d -= rho_dn(shift_y(x, -1), shift_x(y, +1));
+			d += rho_dn(shift_x(x, +1), shift_x(y, -1));
+			d += rho_dn(shift_x(x, -1), shift_x(y, -1));
+			d -= rho_dn(shift_y(x, +1), shift_x(y, -1));
+			d -= rho_dn(shift_y(x, -1), shift_x(y, -1));
+			d -= rho_dn(shift_x(x, +1), shift_y(y, +1));
+			d -= rho_dn(shift_x(x, -1), shift_y(y, +1));
+			d += rho_dn(shift_y(x, +1), shift_y(y, +1));
+			d += rho_dn(shift_y(x, -1), shift_y(y, +1));
+			d -= rho_dn(shift_x(x, +1), shift_y(y, -1));
+			d -= rho_dn(shift_x(x, -1), shift_y(y, -1));
+			d += rho_dn(shift_y(x, +1), shift_y(y, -1));
+			d += rho_dn(shift_y(x, -1), shift_y(y, -1));
+			ret += u*d;
+		}
+	}
+	return ret / V / V;
+}
+
+bool close (double a, double b) {
+	return std::fabs(a-b)<=1.0e-10*std::max(1.0, std::fabs(b));
+}
+
+int main () {
+	CorrelationFunctions correlations;
+	correlations.setup(Lx, Ly, Lz);
+	const Matrix_d rho_up = Matrix_d::Random(V, V);
+	const Matrix_d rho_dn = Matrix_d::Random(V, V);
+	ArrayXd spin, density, pair, q;
+	correlations.spin_density(rho_up, rho_dn, spin, density);
+	correlations.d_wave(rho_up, rho_dn, pair);
+	if (!close(pair.sum()/V, pair_correlation(rho_up, rho_dn))) return 1;
+	for (int k=1;k<=Lx/2;k++) {
+		double ssz = 0.0;
+		for (int j=0;j<V;j++) {
+			int x = j;
+			int y = shift_x(j, k);
+			ssz += rho_up(x, x)*rho_up(y, y) + rho_dn(x, x)*rho_dn(y, y);
+			ssz -= rho_up(x, x)*rho_dn(y, y) + rho_dn(x, x)*rho_up(y, y);
+			ssz -= rho_up(x, y)*rho_up(y, x) + rho_dn(x, y)*rho_dn(y, x);
+		}
+		if (!close(V*spin[k*Ly*Lz], 0.25*ssz)) return 1;
+	}
+	for (int r=1;r<V;r++) {
+		double nn = 0.0;
+		for (int y=0;y<V;y++) {
+			int x = shift_y(shift_x(y, r/Ly/Lz), (r/Lz)%Ly);
+			if (correlations.displacement(x, y)!=r) return 1;
+			nn += (rho_up(x, x)+rho_dn(x, x))*(rho_up(y, y)+rho_dn(y, y));
+			nn -= rho_up(x, y)*rho_up(y, x) + rho_dn(x, y)*rho_dn(y, x);
+		}
+		if (!close(V*density[r], nn)) return 1;
+	}
+	for (const ArrayXd *c : { &spin, &density, &pair }) {
+		correlations.structure_factor(*c, q);
+		if (!close(q[0], c->sum())) return 1;
+	}
+	return 0;
+}
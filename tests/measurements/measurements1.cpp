@@ -0,0 +1,47 @@
+#include "measurements.hpp"
+
+#include <random>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// merging two runs gives the mean and errors of one run fed all the samples
+
+const int samples = 1<<12;
+
+bool close (double a, double b) {
+	return std::fabs(a-b)<=1.0e-12*std::max(std::fabs(a), std::fabs(b));
+}
+
+int main () {
+	std::mt19937_64 generator;
+	std::normal_distribution<double> normal(1.0, 2.0);
+	measurement<double> a, b, all, empty;
+	measurement<ArrayXXd> A, B, All;
+	for (int i=0;i<2*samples;i++) {
+		double x = normal(generator);
+		ArrayXXd X = ArrayXXd::Constant(2, 3, x);
+		X(1, 2) = x*x;
+		(i<samples?a:b).add(x);
+		(i<samples?A:B).add(X);
+		all.add(x);
+		All.add(X);
+	}
+	a.merge(b);
+	A.merge(B);
+	if (a.bins()!=all.bins()-1) return 1;
+	for (size_t i=0;i<a.bins();i++) {
+		if (a.samples(i)!=all.samples(i)) return 1;
+		if (!close(a.mean(i), all.mean(i))) return 1;
+		if (!close(a.error(i), all.error(i))) return 1;
+		if (!A.mean(i).isApprox(All.mean(i), 1.0e-12)) return 1;
+		if (!A.error(i).isApprox(All.error(i), 1.0e-12)) return 1;
+	}
+	empty.merge(b);
+	if (empty.bins()!=b.bins() || empty.mean(0)!=b.mean(0)) return 1;
+	b.merge(measurement<double>());
+	if (empty.bins()!=b.bins() || empty.error(0)!=b.error(0)) return 1;
+	return 0;
+}
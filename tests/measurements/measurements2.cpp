@@ -0,0 +1,76 @@
+#include "checkpoint.hpp"
+
+#include <random>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+// measurements and plain records survive a binary checkpoint unchanged, and
+// truncated, foreign or text files are told apart
+
+const char *fn = "measurements2.ckpt";
+
+bool same (const measurement<double> &a, const measurement<double> &b) {
+	if (a.name()!=b.name() || a.bins()!=b.bins()) return false;
+	for (size_t i=0;i<a.bins();i++) {
+		if (a.samples(i)!=b.samples(i)) return false;
+		if (a.sum(i)!=b.sum(i) || a.square(i)!=b.square(i)) return false;
+		if (a.last_value(i)!=b.last_value(i)) return false;
+	}
+	return true;
+}
+
+int main () {
+	std::mt19937_64 generator;
+	std::normal_distribution<double> normal;
+	measurement<double> m;
+	m.set_name("Density");
+	for (int i=0;i<1000;i++) m.add(normal(generator));
+	std::vector<double> fields(77);
+	for (double &x : fields) x = normal(generator);
+
+	CheckpointWriter out;
+	out.write(int64_t(42));
+	out.write(std::string("job"));
+	out.write(fields.data(), fields.size());
+	out.write("density", m);
+	if (!out.commit(fn)) return 1;
+
+	CheckpointReader in;
+	if (!in.open(fn)) return 1;
+	if (in.read<int64_t>()!=42) return 1;
+	if (in.read_string()!="job") return 1;
+	int64_t n;
+	const char *array = in.read_array(n);
+	if (n!=int64_t(fields.size())) return 1;
+	for (int64_t i=0;i<n;i++) if (CheckpointReader::value(array, i)!=fields[i]) return 1;
+	measurement<double> r;
+	if (in.read(r)!="density" || !same(m, r)) return 1;
+	if (!in.good()) return 1;
+	// nothing is left to read
+	in.read<int64_t>();
+	if (in.good()) return 1;
+
+	// a truncated copy opens but runs out while reading
+	std::ifstream src(fn, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+	std::ofstream(fn, std::ios::binary).write(data.data(), data.size()/2);
+	if (!in.open(fn)) return 1;
+	in.read<int64_t>();
+	in.read_string();
+	in.read_array(n);
+	in.read(r);
+	if (in.good()) return 1;
+
+	// another format version is recognized but not good
+	data[8]++;
+	std::ofstream(fn, std::ios::binary).write(data.data(), data.size());
+	if (!in.open(fn) || in.good()) return 1;
+
+	// text checkpoints are left to the Lua loader
+	std::ofstream(fn) << "return { N = 10 }\n";
+	if (in.open(fn)) return 1;
+	std::remove(fn);
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "svd.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// the pivoted QR (UDT) and the SVD decompositions of a product of graded
+// slices agree on the determinant and on (I + B)^-1, and both match the
+// dense matrices while those are still well conditioned
+
+const int V = 16;
+const int N = 40;
+
+MatrixXd slice () {
+	MatrixXd Q = MatrixXd::Random(V, V).householderQr().householderQ();
+	return Q * (1.5*ArrayXd::Random(V)).exp().matrix().asDiagonal() * Q.transpose() * MatrixXd::Random(V, V).householderQr().householderQ();
+}
+
+double logdet (const SVDHelper &s) {
+	return s.S.array().log().sum();
+}
+
+int main () {
+	SVDHelper svd, udt;
+	svd.setMethod(SVDHelper::SVD);
+	udt.setMethod(SVDHelper::UDT);
+	svd.setIdentity(V);
+	udt.setIdentity(V);
+	MatrixXd B = MatrixXd::Identity(V, V);
+	const MatrixXd I = MatrixXd::Identity(V, V);
+	for (int i=0;i<N;i++) {
+		MatrixXd S = slice();
+		svd.U.applyOnTheLeft(S);
+		udt.U.applyOnTheLeft(S);
+		svd.absorbU();
+		udt.absorbU();
+		B.applyOnTheLeft(S);
+		if (i!=2) continue;
+		for (const SVDHelper &s : { svd, udt }) {
+			if (!s.matrix().isApprox(B, 1.0e-10)) return 1;
+			if (!s.inverse().isApprox(B.inverse(), 1.0e-10)) return 1;
+			SVDHelper a;
+			a = s;
+			a.add_identity(0.5);
+			if (!a.matrix().isApprox(I+0.5*B, 1.0e-10)) return 1;
+			a.invertInPlace();
+			if (!a.matrix().isApprox((I+0.5*B).inverse(), 1.0e-10)) return 1;
+			a = s;
+			a.absorbVt();
+			if (!a.matrix().isApprox(B, 1.0e-10)) return 1;
+		}
+	}
+	if (std::fabs(logdet(svd)-logdet(udt))>1.0e-8*std::fabs(logdet(svd))) return 1;
+	SVDHelper a, b;
+	a = svd;
+	b = udt;
+	a.add_identity(1.0);
+	b.add_identity(1.0);
+	if (std::fabs(logdet(a)-logdet(b))>1.0e-8*std::fabs(logdet(a))) return 1;
+	if (!a.inverse().isApprox(b.inverse(), 1.0e-8)) return 1;
+	a.invertInPlace();
+	b.invertInPlace();
+	if (!a.matrix().isApprox(b.matrix(), 1.0e-8)) return 1;
+	a = svd;
+	b = udt;
+	a.add_svd(svd);
+	b.add_svd(udt);
+	if (std::fabs(logdet(a)-logdet(b))>1.0e-8*std::fabs(logdet(a))) return 1;
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include "svd.hpp"
+
+#include <cmath>
+#include <vector>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// the gesdd and gesvj drivers decompose a product of slices like gesvd:
+// same singular values, same B, and the same (I + B)^-1 and determinant
+// after add_identity, add_svd and rank1_update
+
+const int V = 16;
+const int N = 12;
+
+MatrixXd slice () {
+	MatrixXd Q = MatrixXd::Random(V, V).householderQr().householderQ();
+	return Q * (1.0*ArrayXd::Random(V)).exp().matrix().asDiagonal() * Q.transpose() * MatrixXd::Random(V, V).householderQr().householderQ();
+}
+
+double logdet (const SVDHelper &s) {
+	return s.S.array().log().sum();
+}
+
+int main () {
+	std::vector<MatrixXd> slices;
+	for (int i=0;i<N;i++) slices.push_back(slice());
+	const VectorXd u = VectorXd::Random(V);
+	const VectorXd v = VectorXd::Random(V);
+	SVDHelper reference[3];
+	for (int d=0;d<3;d++) {
+		SVDHelper s;
+		s.setMethod(SVDHelper::SVD);
+		s.setDriver(SVDHelper::Driver(d));
+		if (SVDHelper::driverFromName(SVDHelper::driverName(SVDHelper::Driver(d)))!=d) return 1;
+		s.setIdentity(V);
+		for (int i=0;i<N;i++) {
+			s.U.applyOnTheLeft(slices[i]);
+			s.absorbU();
+		}
+		SVDHelper a, b, c;
+		a = s;
+		a.add_identity(1.0);
+		b = s;
+		b.add_svd(a);
+		c = s;
+		c.rank1_update(u, v, 0.5);
+		if (d==SVDHelper::GESVD) {
+			reference[0] = s;
+			reference[1] = a;
+			reference[2] = b;
+			continue;
+		}
+		if (!s.S.isApprox(reference[0].S, 1.0e-8)) return 1;
+		if (!s.matrix().isApprox(reference[0].matrix(), 1.0e-8)) return 1;
+		if (std::fabs(logdet(a)-logdet(reference[1]))>1.0e-8) return 1;
+		if (!a.inverse().isApprox(reference[1].inverse(), 1.0e-8)) return 1;
+		if (std::fabs(logdet(b)-logdet(reference[2]))>1.0e-8) return 1;
+		SVDHelper r;
+		r = reference[0];
+		r.rank1_update(u, v, 0.5);
+		if (std::fabs(logdet(c)-logdet(r))>1.0e-8) return 1;
+	}
+	return 0;
+}
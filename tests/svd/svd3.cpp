@@ -0,0 +1,72 @@
+#include "svd.hpp"
+
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// the sign of det(U*Vt) kept by SVDHelper through every update is the sign
+// of the dense determinant of the matrix it decomposes, for both methods and
+// for even and odd sizes
+
+// orthogonal times positive diagonal: well conditioned, either sign
+MatrixXd factor (int V) {
+	MatrixXd Q = MatrixXd::Random(V, V).householderQr().householderQ();
+	return Q * (0.5*ArrayXd::Random(V)).exp().matrix().asDiagonal();
+}
+
+double dense_sign (const MatrixXd &M) {
+	return M.determinant()<0.0?-1.0:1.0;
+}
+
+bool check (SVDHelper &s, const MatrixXd &M) {
+	return s.sign()==dense_sign(M);
+}
+
+int main () {
+	for (SVDHelper::Method method : { SVDHelper::SVD, SVDHelper::UDT }) {
+		for (int V=4;V<12;V++) {
+			const MatrixXd I = MatrixXd::Identity(V, V);
+			SVDHelper s;
+			s.setMethod(method);
+			s.setIdentity(V);
+			MatrixXd P = I;
+			for (int i=0;i<6;i++) {
+				MatrixXd R = factor(V);
+				s.Vt.applyOnTheRight(R);
+				s.absorbVt();
+				P.applyOnTheRight(R);
+				if (!check(s, P)) return 1;
+				R = factor(V);
+				s.U.applyOnTheLeft(R);
+				s.absorbU();
+				P.applyOnTheLeft(R);
+				if (!check(s, P)) return 1;
+			}
+			SVDHelper a, b, c;
+			a = s;
+			a.add_identity(0.7);
+			if (!check(a, I+0.7*P)) return 1;
+			b = s;
+			b.invertInPlace();
+			if (!check(b, P.inverse())) return 1;
+			b.add_identity(1.3);
+			if (!check(b, I+1.3*P.inverse())) return 1;
+			b.invertInPlace();
+			if (!check(b, (I+1.3*P.inverse()).inverse())) return 1;
+			c = s;
+			c.add_svd(a);
+			if (!check(c, P+I+0.7*P)) return 1;
+			VectorXd u = VectorXd::Random(V), v = VectorXd::Random(V);
+			c = s;
+			c.rank1_update(u, v, -3.0);
+			if (!check(c, P-3.0*u*v.transpose())) return 1;
+			c.product(s, s);
+			if (!check(c, P*P)) return 1;
+			c.product(b, s);
+			if (!check(c, (I+1.3*P.inverse()).inverse()*P)) return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+// V3Configuration lives in the program itself
+#define main v3ct_main
+#include "v3ct.cpp"
+#undef main
+
+#include <random>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+using namespace Eigen;
+
+// slice matrices kept up to date by rank-1 changes alone stay within 1e-12
+// of a rebuild over thousands of insertions and removals
+
+const int L = 4;
+const int slices = 20;
+const double beta = 5.0;
+
+int main () {
+	std::mt19937_64 generator;
+	std::uniform_real_distribution<double> uniform;
+	const int V = L*L;
+	MatrixXd H = MatrixXd::Zero(V, V);
+	for (int x=0;x<L;x++) {
+		for (int y=0;y<L;y++) {
+			int a = x*L+y;
+			int b = ((x+1)%L)*L+y;
+			int c = x*L+(y+1)%L;
+			H(a, b) = H(b, a) = -1.0;
+			H(a, c) = H(c, a) = -1.0;
+		}
+	}
+	SelfAdjointEigenSolver<MatrixXd> es(H);
+	V3Configuration conf;
+	conf.setBeta(beta);
+	conf.setEigenvectors(es.eigenvectors());
+	conf.setEigenvalues(es.eigenvalues());
+	conf.make_slices(slices);
+	conf.setDamageThreshold(1000000);
+	conf.setDriftCheck(0, 1.0e-10);
+	const double dtau = beta/slices;
+	for (int i=0;i<4000;i++) {
+		size_t s = generator()%slices;
+		if (generator()%2 || conf.sliceSize(s)==0) {
+			conf.addVertex(Vertex((s+uniform(generator))*dtau, generator()%V, generator()%2?0.7:-0.7));
+		} else {
+			conf.removeVertex(s, generator()%conf.sliceSize(s));
+		}
+		if (i%500==499) {
+			for (int k=0;k<slices;k++) {
+				if (conf.slice_drift(k)>1.0e-12) return 1;
+			}
+		}
+	}
+	if (conf.driftChecks()!=8*slices || conf.maxDrift()>1.0e-12) return 1;
+	return 0;
+}
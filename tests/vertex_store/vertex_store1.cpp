@@ -0,0 +1,88 @@
+#include "vertex_store.hpp"
+
+#include <set>
+#include <random>
+#include <iterator>
+#include <iostream>
+
+using namespace std;
+
+// random insertions, removals and lookups give the same vertices in the same
+// order as a std::set, and every vertex sits in the slice of its time
+
+struct Vertex {
+	double tau;
+	size_t x;
+	struct Compare {
+		bool operator() (const Vertex &a, const Vertex &b) const {
+			return a.tau<b.tau || (a.tau==b.tau && a.x<b.x);
+		}
+	};
+	Vertex (double t, size_t y) : tau(t), x(y) {}
+};
+
+// the offset from the start of the slice
+struct Offset {
+	typedef double value_type;
+	double operator() (double t) const { return t; }
+};
+
+const double beta = 10.0;
+const size_t slices = 16;
+const int steps = 20000;
+
+int main () {
+	std::mt19937_64 generator;
+	std::uniform_real_distribution<double> time(0.0, beta);
+	VertexStore<Vertex, Vertex::Compare, Offset> store;
+	std::set<Vertex, Vertex::Compare> reference;
+	store.setup(beta, slices);
+	for (int i=0;i<steps;i++) {
+		// times on the slice boundaries and repeated times are the edge cases
+		double t = generator()%4==0?beta/slices*(generator()%slices):time(generator);
+		Vertex v(t, generator()%8);
+		switch (generator()%3) {
+			case 0:
+				if (store.insert(v).second!=reference.insert(v).second) return 1;
+				break;
+			case 1:
+				if (!reference.empty()) {
+					auto r = reference.lower_bound(v);
+					if (r==reference.end()) r = reference.begin();
+					auto s = store.lower_bound(*r);
+					if (s==store.end() || Vertex::Compare()(*s, *r) || Vertex::Compare()(*r, *s)) return 1;
+					store.erase(s);
+					reference.erase(r);
+				}
+				break;
+			default:
+				{
+					auto r = reference.lower_bound(v);
+					auto s = store.lower_bound(v);
+					if ((r==reference.end())!=(s==store.end())) return 1;
+					if (r!=reference.end() && (s->tau!=r->tau || s->x!=r->x)) return 1;
+				}
+				break;
+		}
+		if (store.size()!=reference.size()) return 1;
+	}
+	if (size_t(std::distance(store.begin(), store.end()))!=reference.size()) return 1;
+	auto r = reference.begin();
+	for (auto s=store.begin();s!=store.end();s++, r++) {
+		if (s->tau!=r->tau || s->x!=r->x) return 1;
+		if (s.cached()!=s->tau-beta/slices*store.slice_of(s->tau)) return 1;
+	}
+	size_t total = 0;
+	for (size_t k=0;k<slices;k++) {
+		for (const Vertex &v : store.slice(k)) {
+			if (v.tau<beta/slices*k || v.tau>=beta/slices*(k+1)) return 1;
+		}
+		total += store.slice_size(k);
+	}
+	if (total!=reference.size()) return 1;
+	auto rr = reference.rbegin();
+	for (auto s=store.rbegin();s!=store.rend();s++, rr++) {
+		if (s->tau!=rr->tau || s->x!=rr->x) return 1;
+	}
+	return 0;
+}
@@ -12,6 +12,7 @@ typedef std::complex<Real> Complex;
 
 typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic> Matrix_d;
 typedef Eigen::Matrix<Complex, Eigen::Dynamic, Eigen::Dynamic> Matrix_cd;
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic> Matrix_f;
 typedef Eigen::Array<Real, Eigen::Dynamic, 1> Array_d;
 typedef Eigen::Array<Real, Eigen::Dynamic, Eigen::Dynamic> Array_dd;
 typedef Eigen::Matrix<Real, Eigen::Dynamic, 1> Vector_d;
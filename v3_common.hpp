@@ -0,0 +1,272 @@
+#ifndef V3_COMMON_HPP
+#define V3_COMMON_HPP
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+
+#include <Eigen/Dense>
+
+#include "svd.hpp"
+
+// pieces shared by the V3 continuous time codes (v3ct, pqmc, lct)
+
+// exp(-t*E) and exp(+t*E) for the offset t of a vertex from the start of its
+// slice: within a slice exp(-(b-a)*E) = forward(b)*backward(a), so the
+// exponentials are taken once per vertex and not for every gap
+struct SlicePropagator {
+	struct value_type {
+		Eigen::ArrayXd forward, backward;
+	};
+	Eigen::ArrayXd eigenvalues;
+	value_type operator() (double t) const {
+		value_type ret;
+		ret.forward = (-t*eigenvalues).exp();
+		ret.backward = ret.forward.inverse();
+		return ret;
+	}
+	SlicePropagator () {}
+	SlicePropagator (const Eigen::ArrayXd &E) : eigenvalues(E) {}
+};
+
+// the pending block I + V^T M U of a V3Updater for one spin. M U and the
+// inverse of the block are kept, so that appending column k to U and V costs
+// O(V^2 + k^2) through the Schur complement instead of a new determinant
+struct V3PendingBlock {
+	Eigen::MatrixXd MU;
+	Eigen::MatrixXd inverse;
+	Eigen::VectorXd Mu, c, r, x, y;
+	double schur;
+
+	void resize (int v) {
+		MU.resize(v, v);
+		inverse.resize(v, v);
+	}
+
+	// det of the block with column k over det of the block without it
+	double propose (const Eigen::MatrixXd &M, const Eigen::MatrixXd &U, const Eigen::MatrixXd &V, int k) {
+		Mu.noalias() = M * U.col(k);
+		c.noalias() = V.leftCols(k).transpose() * Mu;
+		r.noalias() = MU.leftCols(k).transpose() * V.col(k);
+		x.noalias() = inverse.topLeftCorner(k, k) * c;
+		schur = 1.0 + V.col(k).dot(Mu) - r.dot(x);
+		return schur;
+	}
+
+	// grows the inverse by the last proposed column
+	void accept (int k) {
+		y.noalias() = inverse.topLeftCorner(k, k).transpose() * r;
+		inverse.topLeftCorner(k, k).noalias() += x * y.transpose() / schur;
+		inverse.block(0, k, k, 1) = -x / schur;
+		inverse.block(k, 0, 1, k) = -y.transpose() / schur;
+		inverse(k, k) = 1.0 / schur;
+		MU.col(k) = Mu;
+	}
+};
+
+// how far the slice matrices kept up to date by rank-1 changes have drifted
+// from a rebuild: every interval changes one slice is compared, and if it
+// drifted too far the number of changes before a rebuild is halved, down to
+// one, so that slices still take rank-1 changes
+struct SliceDrift {
+	size_t interval; // compare a slice to a rebuild every this many changes, 0 never
+	double tolerance;
+	size_t changes;
+	size_t checks;
+	double max;
+
+	SliceDrift () : interval(1000), tolerance(1.0e-10), changes(0), checks(0), max(0.0) {}
+
+	bool due () {
+		return interval!=0 && ++changes%interval==0;
+	}
+
+	// relative deviation of the maintained A, B from the rebuilt A0, B0
+	double record (const Eigen::MatrixXd &A, const Eigen::MatrixXd &B, const Eigen::MatrixXd &A0, const Eigen::MatrixXd &B0) {
+		double ret = std::max((A-A0).norm()/A0.norm(), (B-B0).norm()/B0.norm());
+		checks++;
+		max = std::max(max, ret);
+		return ret;
+	}
+
+	void adapt (size_t index, double d, int &damage_threshold) const {
+		if (d>tolerance && damage_threshold>1) {
+			damage_threshold /= 2;
+			std::cerr << "slice " << index << " drifted by " << d << ", rebuilding after " << damage_threshold << " changes" << std::endl;
+		}
+	}
+};
+
+// u and v of the rank-1 change u v^T that vertex w makes to its slice of the
+// spin with sign s: the row of w is carried to the end of the slice for u and
+// back to its start for v, with the exponentials cached in the vertex store
+template <typename Store, typename Vertex>
+void slice_update_vectors (const Store &verts, const Eigen::MatrixXd &eigenvectors, double beta, size_t n,
+		const Vertex &w, double s, Eigen::VectorXd &u, Eigen::VectorXd &v, Eigen::VectorXd &cache) {
+	size_t index = verts.slice_of(w.tau);
+	double t0 = beta/n*index, t1 = beta/n*(index+1);
+	auto first = verts.lower_bound(Vertex(t0, 0, 0));
+	auto last = verts.lower_bound(Vertex(t1, 0, 0));
+	auto now = verts.lower_bound(Vertex(w.tau, 0, 0));
+	u = eigenvectors.row(w.x).transpose();
+	v = eigenvectors.row(w.x).transpose();
+	const auto own = verts.cache_at(w.tau);
+	const Eigen::ArrayXd *back = &own.backward;
+	const Eigen::ArrayXd *fwd = &own.forward;
+
+	double t = w.tau;
+	for (auto i=now;i!=last;) {
+		if (i->tau==w.tau) {
+			i++;
+			continue;
+		}
+		if (i->tau>t) {
+			u.array() *= i.cached().forward * *back;
+			back = &i.cached().backward;
+			t = i->tau;
+		}
+		u += s * i->sigma * eigenvectors.row(i->x).transpose() * (eigenvectors.row(i->x) * u);
+		++i;
+	}
+	if (t1>t) {
+		u.array() *= verts.slice_cache().forward * *back;
+	}
+
+	t = w.tau;
+	for (auto i=now;first!=verts.end();) {
+		if (i!=verts.end() && i->tau<t) {
+			v.array() *= *fwd * i.cached().backward;
+			fwd = &i.cached().forward;
+			t = i->tau;
+		}
+		auto j = i;
+		while (j!=first && std::prev(j)->tau==t) { j--; }
+		if (std::distance(j, i)==0 && t<w.tau) {
+			v += s * i->sigma * eigenvectors.row(i->x).transpose() * (eigenvectors.row(i->x) * v);
+		} else if (t!=w.tau) {
+			cache.setZero(eigenvectors.rows());
+			for (auto k=i;std::prev(k)!=j;k--) {
+				cache += s * k->sigma * eigenvectors.row(k->x).transpose() * (eigenvectors.row(k->x) * v);
+			}
+			v += cache;
+		}
+		if (j==first) {
+			break;
+		} else {
+			i = std::prev(j);
+		}
+	}
+	if (t0<t) {
+		v.array() *= *fwd;
+	}
+
+	u *= s * w.sigma;
+}
+
+// relative difference of the Green functions (a^-1 + c)^-1: unlike the
+// singular values alone it also sees errors in U and Vt, and it stays
+// bounded where the products do not
+inline double green_distance (SVDHelper a, SVDHelper b, double c) {
+	a.invertInPlace();
+	b.invertInPlace();
+	a.add_identity(c);
+	b.add_identity(c);
+	a.invertInPlace();
+	b.invertInPlace();
+	Eigen::MatrixXd Ga = a.matrix();
+	Eigen::MatrixXd Gb = b.matrix();
+	return (Ga-Gb).norm()/std::max(Gb.norm(), 1.0e-300);
+}
+
+// products of the slice matrices kept as SVDs: prefix[k] = S_{k-1}...S_0 and
+// suffix[k] = S_{n-1}...S_k, so the product from slice m is
+// prefix[m]*suffix[m]. prefix[0..prefix_valid] and suffix[suffix_valid..n]
+// are up to date with the slice versions in versions. Every check_interval
+// uses the caller compares a product to one from the vertices
+struct SliceStack {
+	std::vector<SVDHelper> prefix, suffix;
+	std::vector<size_t> versions;
+	size_t prefix_valid, suffix_valid;
+	size_t uses;
+	size_t check_interval; // recompute from the vertices every this many uses, 0 never
+	double tolerance; // relative, on the Green function
+	size_t rebuilds;
+	double drift;
+
+	SliceStack () : prefix_valid(0), suffix_valid(0), uses(0), check_interval(100),
+		tolerance(1.0e-6), rebuilds(0), drift(0.0) {}
+
+	// brings the products needed for slice index up to date: a changed
+	// slice k invalidates the prefixes above k and the suffixes up to k,
+	// and only the missing ones between the valid ends and index are redone
+	template <typename Configuration>
+	void update (const Configuration &conf, size_t index) {
+		const size_t n = conf.sliceNumber();
+		const size_t V = conf.volume();
+		if (versions.size()!=n || prefix.size()!=n+1 || prefix[0].S.size()!=int(V)) {
+			prefix.assign(n+1, SVDHelper());
+			suffix.assign(n+1, SVDHelper());
+			prefix[0].setIdentity(V);
+			suffix[n].setIdentity(V);
+			versions.assign(n, size_t(-1));
+			prefix_valid = 0;
+			suffix_valid = n;
+			rebuilds++;
+		}
+		for (size_t k=0;k<n;k++) {
+			if (conf.sliceVersion(k)!=versions[k]) {
+				prefix_valid = std::min(prefix_valid, k);
+				suffix_valid = std::max(suffix_valid, k+1);
+				versions[k] = conf.sliceVersion(k);
+			}
+		}
+		for (;prefix_valid<index;prefix_valid++) {
+			prefix[prefix_valid+1] = prefix[prefix_valid];
+			prefix[prefix_valid+1].U.applyOnTheLeft(conf.slice_up(prefix_valid));
+			prefix[prefix_valid+1].absorbU();
+		}
+		for (;suffix_valid>index;suffix_valid--) {
+			suffix[suffix_valid-1] = suffix[suffix_valid];
+			suffix[suffix_valid-1].Vt.applyOnTheRight(conf.slice_up(suffix_valid-1));
+			suffix[suffix_valid-1].absorbVt();
+		}
+	}
+
+	void invalidate () {
+		versions.clear();
+	}
+
+	// R^-1 * prefix[index] * suffix[index] * R
+	template <typename Configuration>
+	void collect (const Configuration &conf, size_t index, const Eigen::MatrixXd &R, const Eigen::MatrixXd &R_inverse, SVDHelper &out) {
+		update(conf, index);
+		out.product(prefix[index], suffix[index]);
+		out.Vt.applyOnTheRight(R);
+		out.absorbVt();
+		out.U.applyOnTheLeft(R_inverse);
+		out.absorbU();
+	}
+
+	// whether this use is to be compared to a product from the vertices
+	bool check_due () {
+		return check_interval!=0 && uses++%check_interval==0;
+	}
+
+	// a product more than tolerance away from the one from the vertices
+	// rebuilds the stack on the next use
+	void record (double d) {
+		drift = std::max(drift, d);
+		if (d>tolerance) {
+			std::cerr << "slice stack drifted by " << d << ", rebuilding" << std::endl;
+			invalidate();
+		}
+	}
+
+	void report (std::ostream &out) const {
+		out << "slice stack: " << rebuilds << " rebuilds, max drift " << drift << std::endl;
+	}
+};
+
+#endif // V3_COMMON_HPP
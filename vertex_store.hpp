@@ -0,0 +1,190 @@
+#ifndef VERTEX_STORE_HPP
+#define VERTEX_STORE_HPP
+
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <cstddef>
+
+// the default cache of VertexStore holds nothing
+struct NoVertexCache {
+	struct value_type {};
+	value_type operator() (double) const { return value_type(); }
+};
+
+// ordered set of vertices bucketed by time slice: slice s holds the vertices
+// with beta/n*s <= tau < beta/n*(s+1) as a sorted contiguous array, and a
+// last bucket catches tau >= beta. Iteration runs over all buckets in order,
+// so the interface follows the parts of std::set the configurations use;
+// on top of it the size of a slice is O(1) and its index-th vertex is O(1).
+// Inserting and erasing move the tail of one slice only. Iterators are
+// invalidated by any change to the slice they point into or by setup().
+//
+// Alongside every vertex the store keeps cache(tau-t0) where t0 is the start
+// of its slice. It depends on the vertex alone, so it is computed once on
+// insertion and only recomputed when setup() or setCache() change the slices.
+// The cache of a whole slice, cache(beta/n), is kept as well.
+template <typename Vertex, typename Compare = typename Vertex::Compare, typename Cache = NoVertexCache>
+class VertexStore {
+	typedef typename Cache::value_type cached_type;
+
+	std::vector<std::vector<Vertex>> buckets;
+	std::vector<std::vector<cached_type>> cached;
+	cached_type whole_slice;
+	Cache cache;
+	double beta;
+	size_t n;
+	size_t count;
+
+	size_t bucket (double tau) const {
+		if (n==0) return 0;
+		size_t s = tau>0.0?std::min(size_t(tau/beta*n), n):0;
+		while (s>0 && tau<beta/n*s) s--;
+		while (s<n && tau>=beta/n*(s+1)) s++;
+		return s;
+	}
+
+	// without slices the offsets span all of beta, so nothing is cached
+	cached_type make_cached (size_t b, double tau) const {
+		return n>0 && b<n?cache(tau-beta/n*b):cached_type();
+	}
+
+	void recompute () {
+		cached.resize(buckets.size());
+		for (size_t b=0;b<buckets.size();b++) {
+			cached[b].clear();
+			cached[b].reserve(buckets[b].size());
+			for (const Vertex &v : buckets[b]) cached[b].push_back(make_cached(b, v.tau));
+		}
+		whole_slice = n>0?cache(beta/n):cached_type();
+	}
+
+	public:
+
+	class const_iterator : public std::iterator<std::bidirectional_iterator_tag, const Vertex> {
+		const VertexStore *store;
+		size_t b, i;
+
+		// moves forward past empty buckets, end() is (buckets.size(), 0)
+		void settle () {
+			while (b<store->buckets.size() && i>=store->buckets[b].size()) {
+				b++;
+				i = 0;
+			}
+		}
+
+		friend class VertexStore;
+
+		const_iterator (const VertexStore *s, size_t bb, size_t ii) : store(s), b(bb), i(ii) { settle(); }
+
+		public:
+
+		const_iterator () : store(nullptr), b(0), i(0) {}
+
+		const Vertex& operator* () const { return store->buckets[b][i]; }
+		const Vertex* operator-> () const { return &store->buckets[b][i]; }
+		const cached_type& cached () const { return store->cached[b][i]; }
+
+		const_iterator& operator++ () {
+			i++;
+			settle();
+			return *this;
+		}
+
+		const_iterator& operator-- () {
+			if (i>0) {
+				i--;
+			} else {
+				do { b--; } while (store->buckets[b].empty());
+				i = store->buckets[b].size()-1;
+			}
+			return *this;
+		}
+
+		const_iterator operator++ (int) { const_iterator ret = *this; ++*this; return ret; }
+		const_iterator operator-- (int) { const_iterator ret = *this; --*this; return ret; }
+
+		bool operator== (const const_iterator &other) const { return b==other.b && i==other.i; }
+		bool operator!= (const const_iterator &other) const { return b!=other.b || i!=other.i; }
+	};
+
+	typedef const_iterator iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	typedef const_reverse_iterator reverse_iterator;
+
+	// n time slices of the interval [0, b), existing vertices are redistributed
+	void setup (double b, size_t slices) {
+		std::vector<Vertex> all;
+		all.reserve(count);
+		for (const std::vector<Vertex> &v : buckets) all.insert(all.end(), v.begin(), v.end());
+		beta = b;
+		n = slices;
+		buckets.assign(n+1, std::vector<Vertex>());
+		for (const Vertex &v : all) buckets[bucket(v.tau)].push_back(v);
+		recompute();
+	}
+
+	void setCache (const Cache &c) {
+		cache = c;
+		recompute();
+	}
+
+	const_iterator begin () const { return const_iterator(this, 0, 0); }
+	const_iterator end () const { return const_iterator(this, buckets.size(), 0); }
+	const_reverse_iterator rbegin () const { return const_reverse_iterator(end()); }
+	const_reverse_iterator rend () const { return const_reverse_iterator(begin()); }
+
+	size_t size () const { return count; }
+	bool empty () const { return count==0; }
+
+	const_iterator lower_bound (const Vertex &v) const {
+		const size_t b = bucket(v.tau);
+		const std::vector<Vertex> &s = buckets[b];
+		return const_iterator(this, b, std::lower_bound(s.begin(), s.end(), v, Compare())-s.begin());
+	}
+
+	// like std::set, an equivalent vertex already present is kept
+	std::pair<const_iterator, bool> insert (const Vertex &v) {
+		const size_t b = bucket(v.tau);
+		std::vector<Vertex> &s = buckets[b];
+		auto i = std::lower_bound(s.begin(), s.end(), v, Compare());
+		if (i!=s.end() && !Compare()(v, *i)) return std::make_pair(const_iterator(this, b, i-s.begin()), false);
+		cached[b].insert(cached[b].begin()+(i-s.begin()), make_cached(b, v.tau));
+		i = s.insert(i, v);
+		count++;
+		return std::make_pair(const_iterator(this, b, i-s.begin()), true);
+	}
+
+	const_iterator erase (const_iterator i) {
+		buckets[i.b].erase(buckets[i.b].begin()+i.i);
+		cached[i.b].erase(cached[i.b].begin()+i.i);
+		count--;
+		return const_iterator(this, i.b, i.i);
+	}
+
+	const_iterator erase (const_iterator first, const_iterator last) {
+		for (ptrdiff_t k=std::distance(first, last);k>0;k--) first = erase(first);
+		return first;
+	}
+
+	void clear () {
+		for (std::vector<Vertex> &s : buckets) s.clear();
+		for (std::vector<cached_type> &c : cached) c.clear();
+		count = 0;
+	}
+
+	size_t slices () const { return n; }
+	size_t slice_of (double tau) const { return std::min(bucket(tau), n>0?n-1:0); }
+	size_t slice_size (size_t s) const { return buckets[s].size(); }
+	const std::vector<Vertex>& slice (size_t s) const { return buckets[s]; }
+	const cached_type& slice_cache () const { return whole_slice; }
+	// what would be cached for a vertex at tau
+	cached_type cache_at (double tau) const { return make_cached(bucket(tau), tau); }
+
+	// index-th vertex of slice s, or the end of the slice
+	const_iterator pick (size_t s, size_t index) const { return const_iterator(this, s, index); }
+
+	VertexStore () : buckets(1), cached(1), beta(1.0), n(0), count(0) {}
+};
+
+#endif // VERTEX_STORE_HPP
@@ -0,0 +1,91 @@
+#ifndef WRITER_THREAD_HPP
+#define WRITER_THREAD_HPP
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <iostream>
+
+extern "C" {
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+}
+
+// runs file output on a thread of its own, which is the only one touching the
+// shared Lua state while it is alive. Producers hand over tasks through a
+// lock-free stack and never wait; the writer takes the whole stack at once and
+// runs it oldest first, so tasks from one producer keep their order.
+class WriterThread {
+	struct Task {
+		std::function<void(lua_State*)> run;
+		Task *next;
+	};
+
+	lua_State *L;
+	std::atomic<Task*> head;
+	std::atomic<bool> quit;
+	std::mutex lock; // only for sleeping, producers never take it
+	std::condition_variable cond;
+	std::thread worker;
+
+	void drain () {
+		Task *t = head.exchange(nullptr);
+		Task *list = nullptr;
+		while (t!=nullptr) {
+			Task *next = t->next;
+			t->next = list;
+			list = t;
+			t = next;
+		}
+		while (list!=nullptr) {
+			Task *next = list->next;
+			try {
+				list->run(L);
+			} catch (...) {
+				std::cerr << "writer thread: task failed" << std::endl;
+			}
+			delete list;
+			list = next;
+		}
+	}
+
+	void loop () {
+		while (!quit.load()) {
+			drain();
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait_for(guard, std::chrono::milliseconds(100), [this] () { return quit.load() || head.load()!=nullptr; });
+		}
+		drain();
+	}
+
+	public:
+
+	void push (std::function<void(lua_State*)> f) {
+		Task *t = new Task;
+		t->run = std::move(f);
+		t->next = head.load();
+		while (!head.compare_exchange_weak(t->next, t)) {}
+		cond.notify_one();
+	}
+
+	// runs the remaining tasks and returns the Lua state to the caller
+	void stop () {
+		if (!worker.joinable()) return;
+		quit = true;
+		cond.notify_one();
+		worker.join();
+	}
+
+	WriterThread (lua_State *l) : L(l), head(nullptr), quit(false) {
+		worker = std::thread(&WriterThread::loop, this);
+	}
+	WriterThread (const WriterThread &) = delete;
+	WriterThread& operator= (const WriterThread &) = delete;
+	~WriterThread () { stop(); }
+};
+
+#endif // WRITER_THREAD_HPP